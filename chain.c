@@ -0,0 +1,305 @@
+//
+// JTAG chain discovery.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xpc.h"
+#include "jtag.h"
+#include "chain.h"
+
+// Large enough for the IDCODE and the IR scans, with the navigation.
+#define VEC_BYTES ((32 * (CHAIN_MAX_DEVICES + 1) + 2 * CHAIN_MAX_IR + 64) / 8)
+
+// Build a vector and send it with io_scan.
+struct vec
+{
+  unsigned char tms[VEC_BYTES];
+  unsigned char tdi[VEC_BYTES];
+  unsigned char tdo[VEC_BYTES];
+  int len;
+};
+
+static void vec_add(struct vec *v, int tms, int tdi)
+{
+  if (tms)
+    v->tms[v->len / 8] |= 1 << (v->len & 7);
+  if (tdi)
+    v->tdi[v->len / 8] |= 1 << (v->len & 7);
+  v->len++;
+}
+
+static void vec_path(struct vec *v, int from, int to)
+{
+  unsigned tms;
+  int n = jtag_path(from, to, &tms);
+  int i;
+
+  for (i = 0; i < n; i++)
+    vec_add(v, (tms >> i) & 1, 0);
+}
+
+static int vec_bit(const struct vec *v, int i)
+{
+  return (v->tdo[i / 8] >> (i & 7)) & 1;
+}
+
+//
+// Shift N0 zeros then N1 ones in shift_ir or shift_dr, from
+// run_test_idle (or test_logic_reset if RESET) back to run_test_idle.
+// Return the position in TDO of the first shifted bit.
+//
+static int shift_fill(struct vec *v, int ir, int reset, int n0, int n1)
+{
+  int from = reset ? test_logic_reset : run_test_idle;
+  int shift = ir ? shift_ir : shift_dr;
+  int start, i;
+
+  memset(v, 0, sizeof(*v));
+  if (reset)
+    for (i = 0; i < 5; i++)
+      vec_add(v, 1, 0);
+  vec_path(v, from, shift);
+  start = v->len;
+  for (i = 0; i < n0 + n1; i++)
+    vec_add(v, i == n0 + n1 - 1, i >= n0);
+  vec_path(v, ir ? exit1_ir : exit1_dr, run_test_idle);
+
+  if (io_scan(v->tdi, v->tms, v->tdo, v->len) < 0)
+    return -1;
+  return start;
+}
+
+// Number of splits of the IR capture accepted before giving up.
+#define CHAIN_MAX_SPLITS 2
+
+struct split
+{
+  const unsigned char *cap;	// capture pattern, one bit per byte
+  int len;
+  int ndev;
+  int cur[CHAIN_MAX_DEVICES];
+  int found[CHAIN_MAX_SPLITS][CHAIN_MAX_DEVICES];
+  int nfound;
+  // Splits of the bits from POS between the devices from DEV, at most
+  // CHAIN_MAX_SPLITS; -1 until counted.
+  signed char count[CHAIN_MAX_DEVICES + 1][CHAIN_MAX_IR + 1];
+};
+
+static int split_count(struct split *s, int dev, int pos)
+{
+  int l, n = 0;
+
+  if (s->count[dev][pos] >= 0)
+    return s->count[dev][pos];
+  if (dev == s->ndev)
+    n = pos == s->len;
+  else if (pos + 2 <= s->len && s->cap[pos] && !s->cap[pos + 1])
+    for (l = 2; pos + l <= s->len && n < CHAIN_MAX_SPLITS; l++)
+      n += split_count(s, dev + 1, pos + l);
+  if (n > CHAIN_MAX_SPLITS)
+    n = CHAIN_MAX_SPLITS;
+  s->count[dev][pos] = n;
+  return n;
+}
+
+//
+// Find the ways to split the IR capture pattern so that each device
+// starts with "01" (LSB first: 1 then 0), as required by IEEE 1149.1.
+// The counts are memoized, so that only the branches that lead to a
+// split are walked.
+//
+static void split_ir(struct split *s, int dev, int pos)
+{
+  int l;
+
+  if (dev == s->ndev)
+    {
+      if (pos == s->len && s->nfound < CHAIN_MAX_SPLITS)
+        memcpy(s->found[s->nfound++], s->cur, sizeof(s->cur));
+      return;
+    }
+  if (split_count(s, dev, pos) == 0)
+    return;
+
+  for (l = 2; pos + l <= s->len && s->nfound < CHAIN_MAX_SPLITS; l++)
+    {
+      s->cur[dev] = l;
+      split_ir(s, dev + 1, pos + l);
+    }
+}
+
+//
+// Read the IDCODEs after a reset: devices have either IDCODE (LSB is 1)
+// or BYPASS (a single 0) selected.  The ones shifted in mark the end.
+//
+static int read_idcodes(struct vec *v, struct chain *c)
+{
+  int start, pos, i;
+
+  start = shift_fill(v, 0, 1, 0, 32 * (CHAIN_MAX_DEVICES + 1));
+  if (start < 0)
+    return -1;
+  for (pos = 0; pos < 32 * (CHAIN_MAX_DEVICES + 1); )
+    {
+      uint32_t id = 0;
+
+      if (!vec_bit(v, start + pos))
+        {
+          if (c->ndev == CHAIN_MAX_DEVICES + 1)
+            break;
+          c->dev[c->ndev++].idcode = 0;
+          pos++;
+          continue;
+        }
+      for (i = 0; i < 32; i++)
+        id |= (uint32_t)vec_bit(v, start + pos + i) << i;
+      if (id == 0xffffffff)
+        break;
+      if (c->ndev == CHAIN_MAX_DEVICES + 1)
+        break;
+      c->dev[c->ndev++].idcode = id;
+      pos += 32;
+    }
+  return 0;
+}
+
+int chain_discover(struct chain *c, const int *irlens, int nirlens)
+{
+  static struct vec v;
+  struct split s;
+  unsigned char cap[CHAIN_MAX_IR];
+  int start, i, n;
+
+  memset(c, 0, sizeof(*c));
+
+  if (read_idcodes(&v, c) < 0)
+    return -1;
+  if (c->ndev == 0)
+    {
+      fprintf(stderr, "chain: no devices found\n");
+      return -1;
+    }
+  if (c->ndev > CHAIN_MAX_DEVICES)
+    {
+      fprintf(stderr, "chain: more than %d devices\n", CHAIN_MAX_DEVICES);
+      return -1;
+    }
+
+  // IR: the first bits out are the capture pattern, then the zeros
+  // come out after the total IR length.  This leaves all ones (BYPASS).
+  start = shift_fill(&v, 1, 0, CHAIN_MAX_IR, CHAIN_MAX_IR);
+  if (start < 0)
+    return -1;
+  for (i = 0; i < CHAIN_MAX_IR; i++)
+    if (vec_bit(&v, start + CHAIN_MAX_IR + i))
+      break;
+  c->irlen = i;
+  if (c->irlen == 0 || c->irlen == CHAIN_MAX_IR)
+    {
+      fprintf(stderr, "chain: cannot measure the IR length\n");
+      return -1;
+    }
+  for (i = 0; i < c->irlen; i++)
+    cap[i] = vec_bit(&v, start + i);
+
+  // Check the device count with the BYPASS registers.
+  start = shift_fill(&v, 0, 0, 64, 64);
+  if (start < 0)
+    return -1;
+  for (n = 0; n < 64; n++)
+    if (vec_bit(&v, start + 64 + n))
+      break;
+  if (n != c->ndev)
+    {
+      fprintf(stderr, "chain: %d IDCODEs but %d BYPASS bits\n", c->ndev, n);
+      return -1;
+    }
+
+  if (irlens)
+    {
+      int sum = 0;
+
+      if (nirlens != c->ndev)
+        {
+          fprintf(stderr, "chain: %d IR lengths given for %d devices\n",
+                  nirlens, c->ndev);
+          return -1;
+        }
+      for (i = 0; i < c->ndev; i++)
+        {
+          c->dev[i].irlen = irlens[i];
+          sum += irlens[i];
+        }
+      if (sum != c->irlen)
+        {
+          fprintf(stderr, "chain: IR lengths add up to %d, measured %d\n",
+                  sum, c->irlen);
+          return -1;
+        }
+      return 0;
+    }
+
+  memset(&s, 0, sizeof(s));
+  memset(s.count, -1, sizeof(s.count));
+  s.cap = cap;
+  s.len = c->irlen;
+  s.ndev = c->ndev;
+  split_ir(&s, 0, 0);
+
+  // If several splits are possible, accept the one with equal lengths
+  // (identical devices): Xilinx IR captures have status bits that can
+  // look like the start of another device.
+  if (s.nfound == 0)
+    {
+      fprintf(stderr, "chain: cannot split the %d-bit IR, use -I\n",
+              c->irlen);
+      return -1;
+    }
+  if (s.nfound > 1)
+    {
+      n = c->irlen / c->ndev;
+      for (i = 0; i < c->ndev; i++)
+        if (n * c->ndev != c->irlen || !cap[i * n] || cap[i * n + 1])
+          break;
+      if (i < c->ndev)
+        {
+          fprintf(stderr, "chain: ambiguous %d-bit IR, use -I\n", c->irlen);
+          return -1;
+        }
+      for (i = 0; i < c->ndev; i++)
+        s.found[0][i] = n;
+    }
+  for (i = 0; i < c->ndev; i++)
+    c->dev[i].irlen = s.found[0][i];
+
+  return 0;
+}
+
+int chain_validate(const struct chain *c)
+{
+  static struct vec v;
+  struct chain now;
+  int i;
+
+  memset(&now, 0, sizeof(now));
+  if (read_idcodes(&v, &now) < 0)
+    return -1;
+  if (now.ndev != c->ndev)
+    return 0;
+  for (i = 0; i < c->ndev; i++)
+    if (now.dev[i].idcode != c->dev[i].idcode)
+      return 0;
+  return 1;
+}
+
+void chain_print(FILE *f, const struct chain *c)
+{
+  int i;
+
+  for (i = 0; i < c->ndev; i++)
+    fprintf(f, "device %d: idcode 0x%08x, ir length %d\n",
+           i, c->dev[i].idcode, c->dev[i].irlen);
+}
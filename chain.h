@@ -0,0 +1,42 @@
+//
+// JTAG chain topology.
+//
+// Devices are numbered from TDO: device 0 is the first one whose data
+// comes out, and the first bits shifted in end up in it.
+//
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define CHAIN_MAX_DEVICES 32
+
+// Maximum total IR length.
+#define CHAIN_MAX_IR 512
+
+struct chain_device
+{
+  uint32_t idcode;		// 0 if the device has no IDCODE register
+  int irlen;
+};
+
+struct chain
+{
+  int ndev;
+  int irlen;			// sum of the IR lengths
+  // One more, to tell a full chain from a longer one.
+  struct chain_device dev[CHAIN_MAX_DEVICES + 1];
+};
+
+// Discover the chain: read the IDCODEs after a reset and the IR capture
+// pattern, then split the IR between the devices.  IRLENS, if not NULL,
+// gives the NIRLENS IR lengths from device 0 instead.  All the devices
+// are left in BYPASS and the TAP in run_test_idle.
+// Return 0 on success, -1 on error.
+int chain_discover(struct chain *c, const int *irlens, int nirlens);
+
+// Check that the IDCODEs read after a reset are still those of C: one
+// scan, leaving the TAP in run_test_idle.  Return 1 if they are, 0 if
+// not, -1 on error.
+int chain_validate(const struct chain *c);
+
+void chain_print(FILE *f, const struct chain *c);
@@ -0,0 +1,108 @@
+#include <strings.h>
+
+#include "jtag.h"
+#include "probes.h"
+
+const char * const state_name[] =
+  {
+   [test_logic_reset] = "RESET",
+   [run_test_idle]    = "IDLE",
+   [select_dr_scan]   = "DRSELECT",
+   [capture_dr]       = "DRCAPTURE",
+   [shift_dr]         = "DRSHIFT",
+   [exit1_dr]         = "DREXIT1",
+   [pause_dr]         = "DRPAUSE",
+   [exit2_dr]         = "DREXIT2",
+   [update_dr]        = "DRUPDATE",
+   [select_ir_scan]   = "IRSELECT",
+   [capture_ir]       = "IRCAPTURE",
+   [shift_ir]         = "IRSHIFT",
+   [exit1_ir]         = "IREXIT1",
+   [pause_ir]         = "IRPAUSE",
+   [exit2_ir]         = "IREXIT2",
+   [update_ir]        = "IRUPDATE",
+};
+
+// Next state, by state and TMS.
+static const int next_state[num_states][2] =
+{
+	[test_logic_reset] = {run_test_idle, test_logic_reset},
+	[run_test_idle] = {run_test_idle, select_dr_scan},
+
+	[select_dr_scan] = {capture_dr, select_ir_scan},
+	[capture_dr] = {shift_dr, exit1_dr},
+	[shift_dr] = {shift_dr, exit1_dr},
+	[exit1_dr] = {pause_dr, update_dr},
+	[pause_dr] = {pause_dr, exit2_dr},
+	[exit2_dr] = {shift_dr, update_dr},
+	[update_dr] = {run_test_idle, select_dr_scan},
+
+	[select_ir_scan] = {capture_ir, test_logic_reset},
+	[capture_ir] = {shift_ir, exit1_ir},
+	[shift_ir] = {shift_ir, exit1_ir},
+	[exit1_ir] = {pause_ir, update_ir},
+	[pause_ir] = {pause_ir, exit2_ir},
+	[exit2_ir] = {shift_ir, update_ir},
+	[update_ir] = {run_test_idle, select_dr_scan}
+};
+
+int jtag_step(int state, int tms)
+{
+	int next = next_state[state][tms];
+
+	if (next != state)
+		PROBE2(jtag__step, state, next);
+	return next;
+}
+
+int jtag_next(int state, int tms)
+{
+	return next_state[state][tms];
+}
+
+int jtag_state_by_name(const char *name)
+{
+	int i;
+
+	for (i = 0; i < num_states; i++)
+		if (strcasecmp(name, state_name[i]) == 0)
+			return i;
+	return -1;
+}
+
+int jtag_path(int from, int to, unsigned *tms)
+{
+	int dist[num_states];
+	unsigned path[num_states];
+	int queue[num_states];
+	int head = 0, tail = 0;
+	int i;
+
+	// Breadth-first search; TMS=1 is tried first so that the path to
+	// test_logic_reset is the usual sequence of ones.
+	for (i = 0; i < num_states; i++)
+		dist[i] = -1;
+	dist[from] = 0;
+	path[from] = 0;
+	queue[tail++] = from;
+
+	while (head < tail && dist[to] < 0)
+	{
+		int s = queue[head++];
+		int t;
+
+		for (t = 1; t >= 0; t--)
+		{
+			int n = next_state[s][t];
+			if (dist[n] < 0)
+			{
+				dist[n] = dist[s] + 1;
+				path[n] = path[s] | (t << dist[s]);
+				queue[tail++] = n;
+			}
+		}
+	}
+
+	*tms = path[to];
+	return dist[to];
+}
@@ -0,0 +1,33 @@
+//
+// JTAG state machine.
+//
+
+enum jtag_state_t
+{
+	test_logic_reset, run_test_idle,
+
+	select_dr_scan, capture_dr, shift_dr,
+	exit1_dr, pause_dr, exit2_dr, update_dr,
+
+	select_ir_scan, capture_ir, shift_ir,
+	exit1_ir, pause_ir, exit2_ir, update_ir,
+
+	num_states
+};
+
+// State names, as used by SVF.
+extern const char * const state_name[];
+
+// Follow a clock of the cable's TAP, firing the jtag__step probe.
+int jtag_step(int state, int tms);
+
+// Same as jtag_step, for moves that are only looked ahead or that belong
+// to another view of the TAP (no probe).
+int jtag_next(int state, int tms);
+
+// Return the state named NAME, or -1.
+int jtag_state_by_name(const char *name);
+
+// Compute the shortest TMS sequence from FROM to TO, stored LSB first
+// in *TMS.  Return the number of clocks.
+int jtag_path(int from, int to, unsigned *tms);
@@ -0,0 +1,40 @@
+//
+// USDT probes, provider "xvcd", for perf, bpftrace or SystemTap:
+//
+//   bpftrace -e 'usdt:./xvcd:xvcd:scan__done { @[arg0] = count(); }'
+//
+// With <sys/sdt.h> (systemtap-sdt-dev) each probe is a nop instruction
+// plus a note in the ELF file, patched only while a tracer is attached.
+// Without it, or with -DNO_PROBES, the probes compile to nothing.
+//
+// Probes (arguments):
+//   command        (cmd)                 two first letters of an XVC command
+//   shift          (bits, state, zshift) shift: or zshift: vector read
+//   scan__start    (bits, tdo)           io_scan, tdo is 0 when not read
+//   scan__done     (bits, result)
+//   batch__start   (scans)               io_scan_batch
+//   batch__done    (scans, result)
+//   usb__control   (bits, ret)           A6 shift request
+//   usb__out       (bytes, ret, actual)  bulk OUT, TMS/TDI words
+//   usb__in        (bytes, ret, actual)  bulk IN, TDO words
+//   jtag__step     (from, to)            TAP state change
+//   conn__accept   (fd, port)
+//   conn__close    (fd)
+//
+
+#if defined(__has_include) && !defined(NO_PROBES)
+# if __has_include(<sys/sdt.h>)
+#  include <sys/sdt.h>
+#  define HAVE_PROBES 1
+# endif
+#endif
+
+#ifdef HAVE_PROBES
+# define PROBE1(name, a) DTRACE_PROBE1(xvcd, name, a)
+# define PROBE2(name, a, b) DTRACE_PROBE2(xvcd, name, a, b)
+# define PROBE3(name, a, b, c) DTRACE_PROBE3(xvcd, name, a, b, c)
+#else
+# define PROBE1(name, a) do { } while (0)
+# define PROBE2(name, a, b) do { } while (0)
+# define PROBE3(name, a, b, c) do { } while (0)
+#endif
@@ -0,0 +1,113 @@
+//
+// Workload profile.
+//
+
+#include <stdio.h>
+#include <string.h>
+
+#include "jtag.h"
+#include "profile.h"
+
+void profile_reset(struct profile *p)
+{
+  memset(p, 0, sizeof(*p));
+}
+
+void profile_shift(struct profile *p, int len)
+{
+  int k = 0;
+
+  while (k < PROFILE_SIZES - 1 && (len >> (k + 1)) != 0)
+    k++;
+  p->sizes[k]++;
+  p->shifts++;
+}
+
+void profile_states(struct profile *p, int state, const unsigned char *tms,
+                    int len)
+{
+  int i;
+
+  for (i = 0; i < len; i++)
+    {
+      p->state_bits[state]++;
+      state = jtag_next(state, (tms[i / 8] >> (i & 7)) & 1);
+    }
+}
+
+static void add_ir(struct profile *p, uint64_t value, int len,
+                   unsigned count)
+{
+  int i;
+
+  for (i = 0; i < p->nir; i++)
+    if (p->ir[i].value == value && p->ir[i].len == len)
+      break;
+  if (i == p->nir)
+    {
+      if (p->nir == PROFILE_MAX_IRS)
+        {
+          p->ir_other += count;
+          return;
+        }
+      p->ir[i].value = value;
+      p->ir[i].len = len;
+      p->ir[i].count = 0;
+      p->nir++;
+    }
+  p->ir[i].count += count;
+}
+
+void profile_ir(struct profile *p, const unsigned char *bits, int len)
+{
+  uint64_t value = 0;
+  int i;
+
+  for (i = 0; i < len && i < 64; i++)
+    value |= (uint64_t)((bits[i / 8] >> (i & 7)) & 1) << i;
+  add_ir(p, value, len, 1);
+}
+
+void profile_add(struct profile *to, const struct profile *from)
+{
+  int i;
+
+  for (i = 0; i < num_states; i++)
+    to->state_bits[i] += from->state_bits[i];
+  to->shifts += from->shifts;
+  for (i = 0; i < PROFILE_SIZES; i++)
+    to->sizes[i] += from->sizes[i];
+  for (i = 0; i < from->nir; i++)
+    add_ir(to, from->ir[i].value, from->ir[i].len, from->ir[i].count);
+  to->ir_other += from->ir_other;
+  to->bogus += from->bogus;
+  to->transfers += from->transfers;
+  to->tdo_transfers += from->tdo_transfers;
+  to->wasted += from->wasted;
+}
+
+void profile_print(FILE *f, const struct profile *p)
+{
+  int i;
+
+  fprintf(f, "shifts %u, %u dropped as bogus\n", p->shifts, p->bogus);
+  for (i = 0; i < PROFILE_SIZES; i++)
+    if (p->sizes[i])
+      fprintf(f, "  %u-%u bits: %u\n", 1u << i,
+              i < PROFILE_SIZES - 1 ? (2u << i) - 1 : ~0u, p->sizes[i]);
+  fprintf(f, "clocks by state\n");
+  for (i = 0; i < num_states; i++)
+    if (p->state_bits[i])
+      fprintf(f, "  %-10s %llu\n", state_name[i], p->state_bits[i]);
+  fprintf(f, "IR values\n");
+  for (i = 0; i < p->nir; i++)
+    fprintf(f, "  0x%llx/%d: %u\n", (unsigned long long)p->ir[i].value,
+            p->ir[i].len, p->ir[i].count);
+  if (p->ir_other)
+    fprintf(f, "  other: %u\n", p->ir_other);
+  fprintf(f, "transfers %lu, %lu read TDO, %lu of them for nothing",
+          p->transfers, p->tdo_transfers, p->wasted);
+  if (p->tdo_transfers)
+    fprintf(f, " (%.1f%%)", 100.0 * p->wasted / p->tdo_transfers);
+  fprintf(f, "\n");
+}
@@ -0,0 +1,50 @@
+//
+// Workload profile: what clients do with the cable.
+//
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Shifts are counted by size, from 1 bit to 2^(PROFILE_SIZES-1) and up.
+#define PROFILE_SIZES 32
+
+// Distinct IR values counted; the others go in ir_other.
+#define PROFILE_MAX_IRS 32
+
+struct profile_ir
+{
+  uint64_t value;		// first 64 bits, LSB first
+  int len;
+  unsigned count;
+};
+
+struct profile
+{
+  unsigned long long state_bits[16];	// clocks by TAP state before them
+  unsigned shifts;
+  unsigned sizes[PROFILE_SIZES];	// shifts of 2^k to 2^(k+1)-1 bits
+  struct profile_ir ir[PROFILE_MAX_IRS];
+  int nir;
+  unsigned ir_other;
+  unsigned bogus;			// shifts dropped as bogus
+  unsigned long transfers;		// USB shift requests
+  unsigned long tdo_transfers;		// ... that read TDO
+  unsigned long wasted;			// ... for shifts that had no TDO
+};
+
+void profile_reset(struct profile *p);
+
+// Count a shift of LEN bits.
+void profile_shift(struct profile *p, int len);
+
+// Count LEN clocks whose TMS is in TMS, starting from STATE.
+void profile_states(struct profile *p, int state, const unsigned char *tms,
+                    int len);
+
+// Count the LEN bits of BITS loaded into the IR.
+void profile_ir(struct profile *p, const unsigned char *bits, int len);
+
+// Add the counters of FROM to TO.
+void profile_add(struct profile *to, const struct profile *from);
+
+void profile_print(FILE *f, const struct profile *p);
@@ -0,0 +1,1007 @@
+//
+// SVF and XSVF players.
+//
+// Scans are accumulated into a single TMS/TDI vector and sent with one
+// io_scan call; TDO is only read back when it has to be compared, so
+// most of a programming file goes through the large TDO-less transfers.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xpc.h"
+#include "jtag.h"
+#include "svf.h"
+
+// Flush the pending vector when it reaches this number of bits.
+#define SVF_QUEUE_BITS (64 * 1024 * 8)
+
+struct player
+{
+  int state;
+  struct svf_report *rep;
+
+  // Pending vector.
+  unsigned char *tms, *tdi, *tdo;
+  unsigned len, size;
+};
+
+static int get_bit(const unsigned char *v, unsigned i)
+{
+  return (v[i / 8] >> (i & 7)) & 1;
+}
+
+static void set_bit(unsigned char *v, unsigned i, int b)
+{
+  if (b)
+    v[i / 8] |= 1 << (i & 7);
+  else
+    v[i / 8] &= ~(1 << (i & 7));
+}
+
+static int fail(struct player *p, const char *fmt, ...)
+{
+  va_list args;
+
+  if (p->rep->failed)
+    return -1;
+  va_start(args, fmt);
+  vsnprintf(p->rep->msg, sizeof(p->rep->msg), fmt, args);
+  va_end(args);
+  p->rep->failed = 1;
+  return -1;
+}
+
+static int q_add(struct player *p, int tms, int tdi)
+{
+  if (p->len == p->size)
+    {
+      unsigned size = p->size ? 2 * p->size : 4096;
+      unsigned char *v[3];
+      int i;
+
+      for (i = 0; i < 3; i++)
+        {
+          unsigned char **a = i == 0 ? &p->tms : i == 1 ? &p->tdi : &p->tdo;
+          v[i] = realloc(*a, size / 8);
+          if (v[i] == NULL)
+            return fail(p, "out of memory");
+          *a = v[i];
+        }
+      p->size = size;
+    }
+  set_bit(p->tms, p->len, tms);
+  set_bit(p->tdi, p->len, tdi);
+  p->len++;
+  p->state = jtag_step(p->state, tms);
+  return 0;
+}
+
+static int q_flush(struct player *p, int need_tdo)
+{
+  if (p->len == 0)
+    return 0;
+  p->rep->clocks += p->len;
+  p->rep->transfers++;
+  if (io_scan(p->tdi, p->tms, need_tdo ? p->tdo : NULL, p->len) < 0)
+    {
+      p->rep->lost = 1;
+      return fail(p, "io_scan failed");
+    }
+  p->len = 0;
+  return 0;
+}
+
+static int q_goto(struct player *p, int to)
+{
+  unsigned tms;
+  int n, i;
+
+  if (to == test_logic_reset)
+    {
+      // Don't trust the tracked state for a reset.
+      for (i = 0; i < 5; i++)
+        if (q_add(p, 1, 0) < 0)
+          return -1;
+      return 0;
+    }
+
+  n = jtag_path(p->state, to, &tms);
+  for (i = 0; i < n; i++)
+    if (q_add(p, (tms >> i) & 1, 0) < 0)
+      return -1;
+  return 0;
+}
+
+// Stay COUNT clocks in the current (stable) state, then wait USECS.
+static int q_wait(struct player *p, unsigned long count, unsigned long usecs)
+{
+  int tms = p->state == test_logic_reset;
+
+  while (count--)
+    if (q_add(p, tms, 0) < 0)
+      return -1;
+
+  if (usecs)
+    {
+      if (q_flush(p, 0) < 0)
+        return -1;
+      usleep(usecs);
+    }
+  else if (p->len >= SVF_QUEUE_BITS)
+    return q_flush(p, 0);
+  return 0;
+}
+
+//
+// Shift LEN bits of TDI in shift_ir or shift_dr (IR).  If EXIT, the last
+// bit leaves the shift state and the TAP moves to ENDSTATE.  If TDO is
+// not NULL, the bits read are compared with TDO under MASK (NULL means
+// all ones).  Return 1 on TDO mismatch.
+//
+static int q_scan(struct player *p, int ir, unsigned len,
+                  const unsigned char *tdi, const unsigned char *tdo,
+                  const unsigned char *mask, int exit, int endstate)
+{
+  int shift = ir ? shift_ir : shift_dr;
+  unsigned start, i;
+
+  if (p->state != shift && q_goto(p, shift) < 0)
+    return -1;
+
+  if (tdo)
+    {
+      // Send what is pending without reading TDO back.
+      if (q_flush(p, 0) < 0)
+        return -1;
+    }
+
+  start = p->len;
+  for (i = 0; i < len; i++)
+    if (q_add(p, exit && i == len - 1, get_bit(tdi, i)) < 0)
+      return -1;
+
+  if (exit && q_goto(p, endstate) < 0)
+    return -1;
+
+  p->rep->scans++;
+
+  if (tdo)
+    {
+      p->rep->checks++;
+      if (q_flush(p, 1) < 0)
+        return -1;
+      for (i = 0; i < len; i++)
+        {
+          if (mask && !get_bit(mask, i))
+            continue;
+          if (get_bit(p->tdo, start + i) != get_bit(tdo, i))
+            return 1;
+        }
+    }
+  else if (p->len >= SVF_QUEUE_BITS)
+    return q_flush(p, 0);
+
+  return 0;
+}
+
+static void player_init(struct player *p, int state, struct svf_report *rep)
+{
+  memset(rep, 0, sizeof(*rep));
+  memset(p, 0, sizeof(*p));
+  p->state = state;
+  p->rep = rep;
+}
+
+static int player_end(struct player *p, int r, int *state,
+                      const struct timespec *t0)
+{
+  struct timespec t1;
+
+  if (q_flush(p, 0) < 0)
+    r = -1;
+  free(p->tms);
+  free(p->tdi);
+  free(p->tdo);
+  *state = p->state;
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  p->rep->ms = (t1.tv_sec - t0->tv_sec) * 1e3
+    + (t1.tv_nsec - t0->tv_nsec) / 1e6;
+  return r;
+}
+
+//
+// SVF.
+//
+
+// Sticky values of a SIR/SDR/HIR/HDR/TIR/TDR command.
+struct svf_vec
+{
+  unsigned len;
+  unsigned char *tdi, *tdo, *mask;
+  int has_tdo;
+};
+
+enum { V_HIR, V_HDR, V_TIR, V_TDR, V_SIR, V_SDR, V_NUM };
+
+static const char * const vec_name[V_NUM] =
+  { "HIR", "HDR", "TIR", "TDR", "SIR", "SDR" };
+
+struct svf
+{
+  struct player p;
+  struct svf_vec vec[V_NUM];
+  int enddr, endir;
+  int run_state, end_state;
+  unsigned line;
+
+  // Current statement.
+  char *stmt;
+  unsigned stmt_len, stmt_size;
+  char *tok;
+  int paren;			// a '(' was overwritten at TOK
+};
+
+// Return the next token of the statement: a word or a parenthesized hex
+// string (without the parentheses), or NULL.
+static char *svf_token(struct svf *s)
+{
+  char *t;
+
+  if (!s->paren)
+    {
+      while (isspace((unsigned char)*s->tok))
+        s->tok++;
+      if (*s->tok == 0)
+        return NULL;
+    }
+
+  if (s->paren || *s->tok == '(')
+    {
+      char *w;
+
+      s->paren = 0;
+      t = ++s->tok;
+      w = t;
+      while (*s->tok && *s->tok != ')')
+        {
+          if (!isspace((unsigned char)*s->tok))
+            *w++ = *s->tok;
+          s->tok++;
+        }
+      if (*s->tok == ')')
+        s->tok++;
+      *w = 0;
+      return t;
+    }
+
+  t = s->tok;
+  while (*s->tok && !isspace((unsigned char)*s->tok) && *s->tok != '(')
+    s->tok++;
+  if (*s->tok == '(')
+    {
+      // The next call starts with the parenthesized value.
+      s->paren = 1;
+      *s->tok = 0;
+    }
+  else if (*s->tok)
+    *s->tok++ = 0;
+  return t;
+}
+
+static unsigned char *svf_hex(struct svf *s, const char *hex, unsigned len)
+{
+  unsigned nbytes = (len + 7) / 8;
+  unsigned char *v = calloc(nbytes ? nbytes : 1, 1);
+  int n = strlen(hex);
+  unsigned k;
+
+  if (v == NULL)
+    {
+      fail(&s->p, "out of memory");
+      return NULL;
+    }
+
+  for (k = 0; n > 0; k++)
+    {
+      int c = tolower((unsigned char)hex[--n]);
+      int d;
+
+      if (c >= '0' && c <= '9')
+        d = c - '0';
+      else if (c >= 'a' && c <= 'f')
+        d = c - 'a' + 10;
+      else
+        {
+          free(v);
+          fail(&s->p, "line %u: bad hex digit '%c'", s->line, c);
+          return NULL;
+        }
+      if (4 * k < 8 * nbytes)
+        v[k / 2] |= d << (4 * (k & 1));
+    }
+  return v;
+}
+
+static unsigned char *svf_ones(unsigned len)
+{
+  unsigned nbytes = (len + 7) / 8;
+  unsigned char *v = malloc(nbytes ? nbytes : 1);
+
+  if (v)
+    memset(v, 0xff, nbytes ? nbytes : 1);
+  return v;
+}
+
+static int svf_state(struct svf *s, const char *name)
+{
+  int st = name ? jtag_state_by_name(name) : -1;
+
+  if (st < 0)
+    return fail(&s->p, "line %u: bad state '%s'", s->line,
+                name ? name : "");
+  return st;
+}
+
+static int svf_vector(struct svf *s, int kind)
+{
+  struct svf_vec *v = &s->vec[kind];
+  char *t = svf_token(s);
+  char *end;
+  unsigned len;
+  unsigned char *tdi = NULL, *tdo = NULL, *mask = NULL;
+  int r = -1;
+
+  if (t == NULL || (len = strtoul(t, &end, 10), *end))
+    return fail(&s->p, "line %u: %s: bad length", s->line, vec_name[kind]);
+
+  while ((t = svf_token(s)) != NULL)
+    {
+      char *hex = svf_token(s);
+      unsigned char **dst;
+
+      if (strcasecmp(t, "TDI") == 0)
+        dst = &tdi;
+      else if (strcasecmp(t, "TDO") == 0)
+        dst = &tdo;
+      else if (strcasecmp(t, "MASK") == 0)
+        dst = &mask;
+      else if (strcasecmp(t, "SMASK") == 0)
+        dst = NULL;
+      else
+        {
+          fail(&s->p, "line %u: %s: unexpected '%s'", s->line,
+               vec_name[kind], t);
+          goto out;
+        }
+      if (hex == NULL)
+        {
+          fail(&s->p, "line %u: %s: missing value", s->line, vec_name[kind]);
+          goto out;
+        }
+      if (dst == NULL)
+        continue;
+      free(*dst);
+      *dst = svf_hex(s, hex, len);
+      if (*dst == NULL)
+        goto out;
+    }
+
+  if (len != v->len)
+    {
+      // New length: TDI must be given, MASK defaults to all ones.
+      if (tdi == NULL && len > 0)
+        {
+          fail(&s->p, "line %u: %s: missing TDI", s->line, vec_name[kind]);
+          goto out;
+        }
+      free(v->tdi);
+      free(v->mask);
+      v->tdi = NULL;
+      v->mask = svf_ones(len);
+      v->len = len;
+    }
+  if (tdi)
+    {
+      free(v->tdi);
+      v->tdi = tdi;
+      tdi = NULL;
+    }
+  if (mask)
+    {
+      free(v->mask);
+      v->mask = mask;
+      mask = NULL;
+    }
+  free(v->tdo);
+  v->tdo = tdo;
+  v->has_tdo = tdo != NULL;
+  tdo = NULL;
+  r = 0;
+
+out:
+  free(tdi);
+  free(tdo);
+  free(mask);
+  return r;
+}
+
+// Run a SIR or SDR, with its header and trailer.
+static int svf_scan(struct svf *s, int ir)
+{
+  struct svf_vec *parts[3];
+  unsigned len = 0, pos = 0, i, k;
+  unsigned char *tdi, *tdo, *mask;
+  int check = 0;
+  int r;
+
+  parts[0] = &s->vec[ir ? V_HIR : V_HDR];
+  parts[1] = &s->vec[ir ? V_SIR : V_SDR];
+  parts[2] = &s->vec[ir ? V_TIR : V_TDR];
+
+  for (k = 0; k < 3; k++)
+    {
+      len += parts[k]->len;
+      check |= parts[k]->has_tdo;
+    }
+  if (len == 0)
+    return 0;
+
+  tdi = calloc(1, (len + 7) / 8);
+  tdo = calloc(1, (len + 7) / 8);
+  mask = calloc(1, (len + 7) / 8);
+  if (!tdi || !tdo || !mask)
+    {
+      r = fail(&s->p, "out of memory");
+      goto out;
+    }
+
+  // Header bits go to the devices closest to TDO, so they are shifted
+  // first.
+  for (k = 0; k < 3; k++)
+    {
+      struct svf_vec *v = parts[k];
+      for (i = 0; i < v->len; i++, pos++)
+        {
+          set_bit(tdi, pos, get_bit(v->tdi, i));
+          if (v->has_tdo)
+            {
+              set_bit(tdo, pos, get_bit(v->tdo, i));
+              set_bit(mask, pos, get_bit(v->mask, i));
+            }
+        }
+    }
+
+  r = q_scan(&s->p, ir, len, tdi, check ? tdo : NULL, mask, 1,
+             ir ? s->endir : s->enddr);
+  if (r > 0)
+    r = fail(&s->p, "line %u: TDO mismatch in %u-bit %s scan",
+             s->line, len, ir ? "IR" : "DR");
+
+out:
+  free(tdi);
+  free(tdo);
+  free(mask);
+  return r;
+}
+
+static int svf_runtest(struct svf *s)
+{
+  char *t;
+  unsigned long count = 0;
+  double min_time = 0;
+  int st;
+
+  t = svf_token(s);
+  if (t && (st = jtag_state_by_name(t)) >= 0)
+    {
+      s->run_state = st;
+      s->end_state = st;
+      t = svf_token(s);
+    }
+
+  while (t)
+    {
+      char *unit = svf_token(s);
+      double v = strtod(t, NULL);
+
+      if (strcasecmp(t, "ENDSTATE") == 0)
+        {
+          if ((st = svf_state(s, unit)) < 0)
+            return -1;
+          s->end_state = st;
+        }
+      else if (strcasecmp(t, "MAXIMUM") == 0)
+        svf_token(s);
+      else if (unit && strcasecmp(unit, "SEC") == 0)
+        min_time = v;
+      else if (unit && (strcasecmp(unit, "TCK") == 0
+                        || strcasecmp(unit, "SCK") == 0))
+        count = v;
+      else
+        return fail(&s->p, "line %u: RUNTEST: unexpected '%s'", s->line, t);
+      t = svf_token(s);
+    }
+
+  if (q_goto(&s->p, s->run_state) < 0
+      || q_wait(&s->p, count, (unsigned long)(min_time * 1e6)) < 0)
+    return -1;
+  return q_goto(&s->p, s->end_state);
+}
+
+static int svf_statement(struct svf *s)
+{
+  char *cmd;
+  char *t;
+  int st;
+  int k;
+
+  s->tok = s->stmt;
+  s->paren = 0;
+  cmd = svf_token(s);
+  if (cmd == NULL)
+    return 0;
+
+  s->p.rep->commands++;
+
+  for (k = 0; k < V_NUM; k++)
+    if (strcasecmp(cmd, vec_name[k]) == 0)
+      {
+        if (svf_vector(s, k) < 0)
+          return -1;
+        if (k == V_SIR || k == V_SDR)
+          return svf_scan(s, k == V_SIR);
+        return 0;
+      }
+
+  if (strcasecmp(cmd, "RUNTEST") == 0)
+    return svf_runtest(s);
+
+  if (strcasecmp(cmd, "STATE") == 0)
+    {
+      while ((t = svf_token(s)) != NULL)
+        {
+          if ((st = svf_state(s, t)) < 0 || q_goto(&s->p, st) < 0)
+            return -1;
+        }
+      return 0;
+    }
+
+  if (strcasecmp(cmd, "ENDDR") == 0 || strcasecmp(cmd, "ENDIR") == 0)
+    {
+      if ((st = svf_state(s, svf_token(s))) < 0)
+        return -1;
+      if (toupper((unsigned char)cmd[3]) == 'D')
+        s->enddr = st;
+      else
+        s->endir = st;
+      return 0;
+    }
+
+  // No TRST line on the cable, and TCK frequency is fixed.
+  if (strcasecmp(cmd, "TRST") == 0 || strcasecmp(cmd, "FREQUENCY") == 0)
+    return 0;
+
+  return fail(&s->p, "line %u: unsupported command '%s'", s->line, cmd);
+}
+
+int svf_play(const char *data, unsigned long len, int *state,
+             struct svf_report *rep)
+{
+  struct svf s;
+  struct timespec t0;
+  unsigned long i;
+  int in_comment = 0;
+  int r = 0;
+  int k;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  memset(&s, 0, sizeof(s));
+  player_init(&s.p, *state, rep);
+  s.enddr = run_test_idle;
+  s.endir = run_test_idle;
+  s.run_state = run_test_idle;
+  s.end_state = run_test_idle;
+  s.line = 1;
+
+  for (i = 0; i < len && r == 0; i++)
+    {
+      char c = data[i];
+
+      if (c == '\n')
+        {
+          s.line++;
+          in_comment = 0;
+          c = ' ';
+        }
+      else if (in_comment)
+        continue;
+      else if (c == '!' || (c == '/' && i + 1 < len && data[i + 1] == '/'))
+        {
+          in_comment = 1;
+          continue;
+        }
+
+      if (s.stmt_len + 2 >= s.stmt_size)
+        {
+          char *n;
+          s.stmt_size = s.stmt_size ? 2 * s.stmt_size : 1024;
+          n = realloc(s.stmt, s.stmt_size);
+          if (n == NULL)
+            {
+              r = fail(&s.p, "out of memory");
+              break;
+            }
+          s.stmt = n;
+        }
+
+      if (c == ';')
+        {
+          s.stmt[s.stmt_len] = 0;
+          r = svf_statement(&s);
+          s.stmt_len = 0;
+        }
+      else if (c != '\r')
+        s.stmt[s.stmt_len++] = c;
+    }
+
+  for (k = 0; k < V_NUM; k++)
+    {
+      free(s.vec[k].tdi);
+      free(s.vec[k].tdo);
+      free(s.vec[k].mask);
+    }
+  free(s.stmt);
+
+  return player_end(&s.p, r, state, &t0);
+}
+
+//
+// XSVF (Xilinx XAPP503).
+//
+
+enum
+{
+  XCOMPLETE, XTDOMASK, XSIR, XSDR, XRUNTEST, XRESERVED_5, XRESERVED_6,
+  XREPEAT, XSDRSIZE, XSDRTDO, XSETSDRMASKS, XSDRINC, XSDRB, XSDRC, XSDRE,
+  XSDRTDOB, XSDRTDOC, XSDRTDOE, XSTATE, XENDIR, XENDDR, XSIR2, XCOMMENT,
+  XWAIT
+};
+
+struct xsvf
+{
+  struct player p;
+  const unsigned char *data;
+  unsigned long len, pos;
+  unsigned sdrsize;
+  unsigned char *tdo_mask, *tdo_expected, *tdi;
+  unsigned long runtest;
+  unsigned repeat;
+  int endir, enddr;
+};
+
+static int x_u8(struct xsvf *x, unsigned *v)
+{
+  if (x->pos + 1 > x->len)
+    return fail(&x->p, "truncated XSVF at offset %lu", x->pos);
+  *v = x->data[x->pos++];
+  return 0;
+}
+
+static int x_u32(struct xsvf *x, unsigned long *v, int nbytes)
+{
+  int i;
+
+  if (x->pos + nbytes > x->len)
+    return fail(&x->p, "truncated XSVF at offset %lu", x->pos);
+  *v = 0;
+  for (i = 0; i < nbytes; i++)
+    *v = (*v << 8) | x->data[x->pos++];
+  return 0;
+}
+
+// Read a LEN-bit value, stored MSB first, into *DST (LSB first).
+static int x_vec(struct xsvf *x, unsigned char **dst, unsigned len)
+{
+  unsigned nbytes = (len + 7) / 8;
+  unsigned i;
+
+  if (x->pos + nbytes > x->len)
+    return fail(&x->p, "truncated XSVF at offset %lu", x->pos);
+  free(*dst);
+  *dst = malloc(nbytes ? nbytes : 1);
+  if (*dst == NULL)
+    return fail(&x->p, "out of memory");
+  for (i = 0; i < nbytes; i++)
+    (*dst)[i] = x->data[x->pos + nbytes - 1 - i];
+  x->pos += nbytes;
+  return 0;
+}
+
+// Resize *BUF from OLD_LEN to LEN bits, keeping the bits they have in
+// common and clearing the others.
+static int x_resize(struct xsvf *x, unsigned char **buf, unsigned old_len,
+                    unsigned len)
+{
+  unsigned nbytes = (len + 7) / 8;
+  unsigned keep = old_len < len ? old_len : len;
+  unsigned char *b;
+
+  if (*buf == NULL)
+    return 0;
+  b = realloc(*buf, nbytes ? nbytes : 1);
+  if (b == NULL)
+    return fail(&x->p, "out of memory");
+  if (keep & 7)
+    b[keep / 8] &= (1 << (keep & 7)) - 1;
+  memset(b + (keep + 7) / 8, 0, nbytes - (keep + 7) / 8);
+  *buf = b;
+  return 0;
+}
+
+static int x_mask_empty(struct xsvf *x)
+{
+  unsigned i;
+
+  if (x->tdo_mask == NULL)
+    return 1;
+  for (i = 0; i < (x->sdrsize + 7) / 8; i++)
+    if (x->tdo_mask[i])
+      return 0;
+  return 1;
+}
+
+// Complete XSDR/XSDRTDO, with XREPEAT retries through pause_dr.
+static int x_sdr(struct xsvf *x)
+{
+  unsigned attempt = 0;
+  unsigned long runtest = x->runtest;
+  const unsigned char *tdo = x_mask_empty(x) ? NULL : x->tdo_expected;
+  int r;
+
+  // Stop in exit1_dr to be able to retry.
+  while ((r = q_scan(&x->p, 0, x->sdrsize, x->tdi, tdo, x->tdo_mask,
+                     1, exit1_dr)) > 0)
+    {
+      if (attempt++ >= x->repeat)
+        return fail(&x->p, "TDO mismatch in %u-bit DR scan at offset %lu",
+                    x->sdrsize, x->pos);
+      // exit1_dr -> pause_dr -> exit2_dr -> shift_dr.
+      if (q_add(&x->p, 0, 0) < 0 || q_add(&x->p, 1, 0) < 0
+          || q_add(&x->p, 0, 0) < 0)
+        return -1;
+      runtest += runtest / 4;
+    }
+  if (r < 0 || q_goto(&x->p, x->enddr) < 0)
+    return -1;
+  if (runtest && x->enddr == run_test_idle)
+    return q_wait(&x->p, 0, runtest);
+  return 0;
+}
+
+static int x_state(struct xsvf *x, unsigned v, int *st)
+{
+  if (v >= num_states)
+    return fail(&x->p, "bad XSVF state %u at offset %lu", v, x->pos);
+  *st = v;
+  return 0;
+}
+
+static int xsvf_command(struct xsvf *x, unsigned cmd)
+{
+  unsigned v = 0, w = 0;
+  unsigned long l;
+  int st = 0, st2 = 0;
+  int r;
+
+  switch (cmd)
+    {
+    case XTDOMASK:
+      return x_vec(x, &x->tdo_mask, x->sdrsize);
+
+    case XSIR:
+    case XSIR2:
+      if (cmd == XSIR)
+        {
+          if (x_u8(x, &v) < 0)
+            return -1;
+        }
+      else
+        {
+          if (x_u32(x, &l, 2) < 0)
+            return -1;
+          v = l;
+        }
+      if (x_vec(x, &x->tdi, v) < 0
+          || q_scan(&x->p, 1, v, x->tdi, NULL, NULL, 1, x->endir) < 0)
+        return -1;
+      if (x->runtest && x->endir == run_test_idle)
+        return q_wait(&x->p, 0, x->runtest);
+      return 0;
+
+    case XSDR:
+      if (x_vec(x, &x->tdi, x->sdrsize) < 0)
+        return -1;
+      return x_sdr(x);
+
+    case XSDRTDO:
+      if (x_vec(x, &x->tdi, x->sdrsize) < 0
+          || x_vec(x, &x->tdo_expected, x->sdrsize) < 0)
+        return -1;
+      return x_sdr(x);
+
+    case XRUNTEST:
+      return x_u32(x, &x->runtest, 4);
+
+    case XREPEAT:
+      if (x_u8(x, &v) < 0)
+        return -1;
+      x->repeat = v;
+      return 0;
+
+    case XSDRSIZE:
+      if (x_u32(x, &l, 4) < 0
+          || x_resize(x, &x->tdo_mask, x->sdrsize, l) < 0
+          || x_resize(x, &x->tdo_expected, x->sdrsize, l) < 0)
+        return -1;
+      x->sdrsize = l;
+      return 0;
+
+    case XSDRB:
+    case XSDRC:
+    case XSDRE:
+      if (x_vec(x, &x->tdi, x->sdrsize) < 0)
+        return -1;
+      return q_scan(&x->p, 0, x->sdrsize, x->tdi, NULL, NULL,
+                    cmd == XSDRE, x->enddr);
+
+    case XSDRTDOB:
+    case XSDRTDOC:
+    case XSDRTDOE:
+      if (x_vec(x, &x->tdi, x->sdrsize) < 0
+          || x_vec(x, &x->tdo_expected, x->sdrsize) < 0)
+        return -1;
+      r = q_scan(&x->p, 0, x->sdrsize, x->tdi,
+                 x_mask_empty(x) ? NULL : x->tdo_expected, x->tdo_mask,
+                 cmd == XSDRTDOE, x->enddr);
+      if (r > 0)
+        return fail(&x->p, "TDO mismatch in %u-bit DR scan at offset %lu",
+                    x->sdrsize, x->pos);
+      return r;
+
+    case XSTATE:
+      if (x_u8(x, &v) < 0 || x_state(x, v, &st) < 0)
+        return -1;
+      return q_goto(&x->p, st);
+
+    case XENDIR:
+    case XENDDR:
+      if (x_u8(x, &v) < 0)
+        return -1;
+      if (cmd == XENDIR)
+        x->endir = v ? pause_ir : run_test_idle;
+      else
+        x->enddr = v ? pause_dr : run_test_idle;
+      return 0;
+
+    case XCOMMENT:
+      while (x->pos < x->len && x->data[x->pos] != 0)
+        x->pos++;
+      x->pos++;
+      return 0;
+
+    case XWAIT:
+      if (x_u8(x, &v) < 0 || x_state(x, v, &st) < 0
+          || x_u8(x, &w) < 0 || x_state(x, w, &st2) < 0
+          || x_u32(x, &l, 4) < 0)
+        return -1;
+      if (q_goto(&x->p, st) < 0 || q_wait(&x->p, 0, l) < 0)
+        return -1;
+      return q_goto(&x->p, st2);
+
+    default:
+      return fail(&x->p, "unsupported XSVF command 0x%02x at offset %lu",
+                  cmd, x->pos - 1);
+    }
+}
+
+int xsvf_play(const unsigned char *data, unsigned long len, int *state,
+              struct svf_report *rep)
+{
+  struct xsvf x;
+  struct timespec t0;
+  int r = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  memset(&x, 0, sizeof(x));
+  player_init(&x.p, *state, rep);
+  x.data = data;
+  x.len = len;
+  x.endir = run_test_idle;
+  x.enddr = run_test_idle;
+
+  while (r == 0 && x.pos < x.len)
+    {
+      unsigned cmd = x.data[x.pos++];
+
+      if (cmd == XCOMPLETE)
+        break;
+      rep->commands++;
+      r = xsvf_command(&x, cmd);
+    }
+
+  free(x.tdo_mask);
+  free(x.tdo_expected);
+  free(x.tdi);
+
+  return player_end(&x.p, r, state, &t0);
+}
+
+int svf_play_file(const char *path, int *state, struct svf_report *rep)
+{
+  FILE *f;
+  char *data = NULL;
+  unsigned long len = 0, size = 0;
+  unsigned long n;
+  int plen = strlen(path);
+  int r;
+
+  f = fopen(path, "rb");
+  if (f == NULL)
+    {
+      memset(rep, 0, sizeof(*rep));
+      rep->failed = 1;
+      snprintf(rep->msg, sizeof(rep->msg), "cannot open %s", path);
+      return -1;
+    }
+
+  do
+    {
+      if (len == size)
+        {
+          char *d;
+          size = size ? 2 * size : 65536;
+          d = realloc(data, size);
+          if (d == NULL)
+            {
+              free(data);
+              fclose(f);
+              memset(rep, 0, sizeof(*rep));
+              rep->failed = 1;
+              snprintf(rep->msg, sizeof(rep->msg), "out of memory");
+              return -1;
+            }
+          data = d;
+        }
+      n = fread(data + len, 1, size - len, f);
+      len += n;
+    }
+  while (n > 0);
+  fclose(f);
+
+  if (plen > 5 && strcasecmp(path + plen - 5, ".xsvf") == 0)
+    r = xsvf_play((unsigned char *)data, len, state, rep);
+  else
+    r = svf_play(data, len, state, rep);
+
+  free(data);
+  return r;
+}
+
+void svf_report_str(const struct svf_report *rep, char *buf, unsigned size)
+{
+  snprintf(buf, size,
+           "%s: %u commands, %u scans, %u checked, %llu clocks, "
+           "%u transfers, %.1f ms%s%s\n",
+           rep->failed ? "FAIL" : "OK",
+           rep->commands, rep->scans, rep->checks, rep->clocks,
+           rep->transfers, rep->ms,
+           rep->msg[0] ? ": " : "", rep->msg);
+}
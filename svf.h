@@ -0,0 +1,30 @@
+//
+// SVF and XSVF players, running a file locally against the cable.
+//
+
+struct svf_report
+{
+  unsigned commands;		// SVF statements or XSVF commands executed
+  unsigned scans;		// IR/DR scans
+  unsigned checks;		// scans whose TDO was compared
+  unsigned long long clocks;	// TCK cycles sent to the cable
+  unsigned transfers;		// io_scan calls
+  double ms;			// wall clock time
+  int failed;
+  int lost;			// io_scan failed: the TAP state is unknown
+  char msg[160];		// error or TDO mismatch
+};
+
+// Play the LEN bytes of SVF text (or XSVF binary) in DATA.  *STATE is the
+// current TAP state, updated on return.  Return 0 on success, -1 on error
+// or TDO mismatch (see REP->msg).
+int svf_play(const char *data, unsigned long len, int *state,
+             struct svf_report *rep);
+int xsvf_play(const unsigned char *data, unsigned long len, int *state,
+              struct svf_report *rep);
+
+// Play the file PATH, an XSVF file if its name ends with .xsvf.
+int svf_play_file(const char *path, int *state, struct svf_report *rep);
+
+// Format REP as a one line summary.
+void svf_report_str(const struct svf_report *rep, char *buf, unsigned size);
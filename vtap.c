@@ -0,0 +1,365 @@
+//
+// Virtual cables: one XVC endpoint per device of the chain.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xpc.h"
+#include "jtag.h"
+#include "chain.h"
+#include "vtap.h"
+
+static const struct chain *chain;
+
+// Client whose IR configuration is loaded, NULL if unknown.
+static struct vtap *owner;
+
+// Length of the DR selected in each device, 0 if unknown.
+static int dr_len[CHAIN_MAX_DEVICES];
+
+// Scan sent to the cable, and for each client bit its position in it,
+// or -1 - TDO if its TDO does not come from the cable.
+static unsigned char *real_tms, *real_tdi, *real_tdo;
+static int *real_pos;
+static int real_len, real_size, pos_size;
+
+void vtap_setup(const struct chain *c)
+{
+  chain = c;
+  owner = NULL;
+}
+
+void vtap_init(struct vtap *v, int dev, int state)
+{
+  memset(v, 0, sizeof(*v));
+  v->dev = dev;
+  v->state = state;
+}
+
+void vtap_invalidate(void)
+{
+  owner = NULL;
+}
+
+static void reset_dr_len(void)
+{
+  int d;
+
+  for (d = 0; d < chain->ndev; d++)
+    dr_len[d] = chain->dev[d].idcode ? 32 : 1;
+}
+
+static int add(int tms, int tdi)
+{
+  int i = real_len;
+
+  if (real_len == real_size)
+    {
+      int size = real_size ? 2 * real_size : 8192;
+      unsigned char *a = realloc(real_tms, size / 8);
+      unsigned char *b = realloc(real_tdi, size / 8);
+      unsigned char *c = realloc(real_tdo, size / 8);
+
+      if (a)
+        real_tms = a;
+      if (b)
+        real_tdi = b;
+      if (c)
+        real_tdo = c;
+      if (!a || !b || !c)
+        {
+          fprintf(stderr, "vtap: out of memory\n");
+          return -1;
+        }
+      memset(real_tms + real_size / 8, 0, (size - real_size) / 8);
+      memset(real_tdi + real_size / 8, 0, (size - real_size) / 8);
+      real_size = size;
+    }
+  if (tms)
+    real_tms[i / 8] |= 1 << (i & 7);
+  if (tdi)
+    real_tdi[i / 8] |= 1 << (i & 7);
+  real_len++;
+  return 0;
+}
+
+static int add_path(int from, int to)
+{
+  unsigned tms;
+  int n = jtag_path(from, to, &tms);
+  int i;
+
+  for (i = 0; i < n; i++)
+    if (add((tms >> i) & 1, 0) < 0)
+      return -1;
+  return 0;
+}
+
+// Number of padding bits for the devices before (closer to TDO) and
+// after V's device, for an IR or DR scan.
+static int pad_len(struct vtap *v, int ir, int after)
+{
+  int d, n = 0;
+  int from = after ? v->dev + 1 : 0;
+  int to = after ? chain->ndev : v->dev;
+
+  for (d = from; d < to; d++)
+    n += ir ? chain->dev[d].irlen : dr_len[d];
+  return n;
+}
+
+static int add_pad(int n, int exit)
+{
+  int i;
+
+  // Ones load BYPASS into the IR of the other devices.
+  for (i = 0; i < n; i++)
+    if (add(exit && i == n - 1, 1) < 0)
+      return -1;
+  return 0;
+}
+
+static void real_reset(void)
+{
+  if (real_size)
+    {
+      memset(real_tms, 0, real_size / 8);
+      memset(real_tdi, 0, real_size / 8);
+    }
+  real_len = 0;
+}
+
+static int real_scan(int *state)
+{
+  int i;
+
+  for (i = 0; i < real_len; i++)
+    *state = jtag_step(*state, (real_tms[i / 8] >> (i & 7)) & 1);
+  return io_scan(real_tdi, real_tms, real_tdo, real_len);
+}
+
+static void loaded_ir(struct vtap *v, int valid)
+{
+  int irlen = chain->dev[v->dev].irlen;
+  uint64_t ones = irlen < 64 ? ((uint64_t)1 << irlen) - 1 : ~(uint64_t)0;
+  int d;
+
+  // The other devices got ones: BYPASS.
+  for (d = 0; d < chain->ndev; d++)
+    if (d != v->dev)
+      dr_len[d] = 1;
+  dr_len[v->dev] = valid && v->ir == ones ? 1 : 0;
+  v->ir_valid = valid;
+  owner = v;
+}
+
+int vtap_acquire(struct vtap *v, int *state)
+{
+  int from = *state;
+  int i;
+
+  if (owner == v && *state == v->state)
+    return 0;
+
+  real_reset();
+  if (owner != v)
+    {
+      if (v->ir_valid && v->state != test_logic_reset)
+        {
+          int n = chain->dev[v->dev].irlen;
+          int post = pad_len(v, 1, 1);
+
+          // Load the client's IR, BYPASS elsewhere.
+          if (add_path(from, shift_ir) < 0
+              || add_pad(pad_len(v, 1, 0), 0) < 0)
+            return -1;
+          for (i = 0; i < n; i++)
+            if (add(post == 0 && i == n - 1, (v->ir >> i) & 1) < 0)
+              return -1;
+          if (add_pad(post, 1) < 0)
+            return -1;
+          from = exit1_ir;
+          if (add_path(from, run_test_idle) < 0)
+            return -1;
+          from = run_test_idle;
+          loaded_ir(v, 1);
+        }
+      else
+        {
+          // The client expects its device to be reset.
+          for (i = 0; i < 5; i++)
+            if (add(1, 0) < 0)
+              return -1;
+          from = test_logic_reset;
+          reset_dr_len();
+          owner = v;
+        }
+    }
+  if (add_path(from, v->state) < 0)
+    return -1;
+
+  if (real_len == 0)
+    return 0;
+  if (real_scan(state) < 0)
+    return -1;
+  *state = v->state;
+  return 0;
+}
+
+static int get_bit(const unsigned char *b, int i)
+{
+  return (b[i / 8] >> (i & 7)) & 1;
+}
+
+//
+// TDO of a client bit shifted into V, -1 - TDO once the client has
+// shifted past the length of its register: it gets back its own TDI, as
+// on a chain of its device alone, and not the registers of the devices
+// between it and TDI.  0 if the TDO comes from the cable, which is also
+// the case when the length of the register is not known.
+//
+static int own_tdo(struct vtap *v, int ir, int tdi)
+{
+  int n = ir ? chain->dev[v->dev].irlen : dr_len[v->dev];
+  int r = 0;
+
+  if (n > 0 && n <= 64 && v->shift_bits >= n)
+    r = -1 - (int)((v->tdi_hist >> (n - 1)) & 1);
+  v->tdi_hist = (v->tdi_hist << 1) | tdi;
+  v->shift_bits++;
+  return r;
+}
+
+//
+// Close a scan that left the shift state without its trailing padding:
+// from exit1 (through pause) or exit2, shift the padding and go back to
+// exit1.  The caller then clocks the client's bit to update.
+//
+static int add_trailer(struct vtap *v, int st)
+{
+  int ir = st == exit1_ir || st == exit2_ir;
+  int n = pad_len(v, ir, 1);
+
+  if (st == exit1_ir || st == exit1_dr)
+    {
+      if (add(0, 0) < 0 || add(1, 0) < 0)	// pause, exit2
+        return -1;
+    }
+  if (add(0, 0) < 0)				// shift
+    return -1;
+  return add_pad(n, 1);				// exit1
+}
+
+int vtap_scan(struct vtap *v, const unsigned char *tms,
+              const unsigned char *tdi, unsigned char *tdo, int len,
+              int *state)
+{
+  int st = v->state;
+  int i;
+
+  if (len <= 0)
+    return 0;
+  if (len > pos_size)
+    {
+      int *p = realloc(real_pos, len * sizeof(int));
+      if (p == NULL)
+        {
+          fprintf(stderr, "vtap: out of memory\n");
+          return -1;
+        }
+      real_pos = p;
+      pos_size = len;
+    }
+
+  real_reset();
+  for (i = 0; i < len; i++)
+    {
+      int t = get_bit(tms, i);
+      int d = get_bit(tdi, i);
+      int own = 0;
+      int next;
+
+      if (st == shift_ir || st == shift_dr)
+        {
+          int ir = st == shift_ir;
+
+          if (!v->in_shift)
+            {
+              if (add_pad(pad_len(v, ir, 0), 0) < 0)
+                return -1;
+              v->in_shift = 1;
+            }
+          own = own_tdo(v, ir, d);
+          if (ir)
+            {
+              if (v->ir_bits < 64)
+                v->ir_shift |= (uint64_t)d << v->ir_bits;
+              v->ir_bits++;
+            }
+
+          // Leaving the shift state straight to update: the trailing
+          // padding goes in now.
+          if (t && i + 1 < len && get_bit(tms, i + 1)
+              && pad_len(v, ir, 1) > 0)
+            {
+              real_pos[i] = own ? own : real_len;
+              if (add(0, d) < 0 || add_pad(pad_len(v, ir, 1), 1) < 0)
+                return -1;
+              v->in_shift = 0;
+              st = jtag_next(st, t);
+              continue;
+            }
+        }
+      else if (t && v->in_shift
+               && (st == exit1_ir || st == exit1_dr
+                   || st == exit2_ir || st == exit2_dr))
+        {
+          // Going to update with the trailing padding still missing.
+          if (pad_len(v, st == exit1_ir || st == exit2_ir, 1) > 0
+              && add_trailer(v, st) < 0)
+            return -1;
+          v->in_shift = 0;
+        }
+
+      real_pos[i] = own ? own : real_len;
+      if (add(t, d) < 0)
+        return -1;
+
+      next = jtag_next(st, t);
+      if (next == capture_ir || next == capture_dr)
+        {
+          v->in_shift = 0;
+          v->shift_bits = 0;
+          v->ir_bits = 0;
+          v->ir_shift = 0;
+        }
+      else if (next == update_ir)
+        {
+          v->ir = v->ir_shift;
+          loaded_ir(v, v->ir_bits == chain->dev[v->dev].irlen);
+          v->in_shift = 0;
+        }
+      else if (next == update_dr)
+        v->in_shift = 0;
+      else if (next == test_logic_reset)
+        {
+          v->ir_valid = 0;
+          v->in_shift = 0;
+          reset_dr_len();
+          owner = v;
+        }
+      st = next;
+    }
+
+  if (real_scan(state) < 0)
+    return -1;
+  v->state = st;
+
+  memset(tdo, 0, (len + 7) / 8);
+  for (i = 0; i < len; i++)
+    if (real_pos[i] < 0 ? real_pos[i] == -2 : get_bit(real_tdo, real_pos[i]))
+      tdo[i / 8] |= 1 << (i & 7);
+  return 0;
+}
@@ -0,0 +1,41 @@
+//
+// Virtual cables: one XVC endpoint per device of the chain.
+//
+// Each client sees a chain made of its device only.  Its scans are
+// padded with the IR and DR bits of the other devices, which are kept in
+// BYPASS, and its IR value is loaded again when it gets the cable back
+// after another client used it.
+//
+
+#include <stdint.h>
+
+struct chain;
+
+struct vtap
+{
+  int dev;			// device in the chain
+  int state;			// TAP state seen by the client
+  int in_shift;			// scan started, trailing padding not done
+  int shift_bits;		// client bits shifted since the capture
+  uint64_t tdi_hist;		// ... the last 64 of them, newest in bit 0
+  int ir_bits;			// client bits shifted into the IR
+  uint64_t ir_shift;		// ... and their value
+  uint64_t ir;			// IR value loaded by the client
+  int ir_valid;
+};
+
+void vtap_setup(const struct chain *c);
+
+void vtap_init(struct vtap *v, int dev, int state);
+
+// Give the cable to V: load its IR if another client changed it and move
+// the TAP from *STATE to the state V is in.  Return 0 or -1 on error.
+int vtap_acquire(struct vtap *v, int *state);
+
+// Run a scan of V on the real chain, updating *STATE.
+int vtap_scan(struct vtap *v, const unsigned char *tms,
+              const unsigned char *tdi, unsigned char *tdo, int len,
+              int *state);
+
+// The whole chain was used directly: forget what is loaded.
+void vtap_invalidate(void);
@@ -29,10 +29,16 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <pthread.h>
 
 #include <libusb-1.0/libusb.h>
 
 #include "xpc.h"
+#include "xpc_pack.h"
+#include "probes.h"
 
 #define URJ_STATUS_FAIL -1
 #define URJ_STATUS_OK 0
@@ -40,6 +46,14 @@
 #define URJ_LOG_LEVEL_NORMAL 1
 #define URJ_LOG_LEVEL_DETAIL 2
 
+/* Timeout of the USB transfers, in ms; see also the adaptive timeouts
+   of the shift requests.  */
+#define XPC_TIMEOUT 1000
+
+/* Diagnostics, set by the application.  */
+int verbose;
+int trace_usb;
+
 //#define VERBOSE 1
 //#undef VERBOSE
 
@@ -84,7 +98,7 @@ static int
 xpcu_output_enable (struct libusb_device_handle *xpcu, int enable)
 {
     if (libusb_control_transfer
-        (xpcu, 0x40, 0xB0, enable ? 0x18 : 0x10, 0, NULL, 0, 1000) < 0)
+        (xpcu, 0x40, 0xB0, enable ? 0x18 : 0x10, 0, NULL, 0, XPC_TIMEOUT) < 0)
     {
         fprintf(stderr, "libusb_control_transfer(0x10/0x18)\n");
         return URJ_STATUS_FAIL;
@@ -100,7 +114,7 @@ xpcu_request_28 (struct libusb_device_handle *xpcu, int value)
 {
     /* Typical values seen during autodetection of chain configuration: 0x11, 0x12 */
 
-    if (libusb_control_transfer (xpcu, 0x40, 0xB0, 0x0028, value, NULL, 0, 1000) < 0)
+    if (libusb_control_transfer (xpcu, 0x40, 0xB0, 0x0028, value, NULL, 0, XPC_TIMEOUT) < 0)
     {
         fprintf(stderr, "libusb_control_transfer(0x28.x)");
         return URJ_STATUS_FAIL;
@@ -114,7 +128,7 @@ xpcu_request_28 (struct libusb_device_handle *xpcu, int value)
 static int
 xpcu_write_gpio (struct libusb_device_handle *xpcu, uint8_t bits)
 {
-    if (libusb_control_transfer (xpcu, 0x40, 0xB0, 0x0030, bits, NULL, 0, 1000) < 0)
+    if (libusb_control_transfer (xpcu, 0x40, 0xB0, 0x0030, bits, NULL, 0, XPC_TIMEOUT) < 0)
     {
         fprintf(stderr, "libusb_control_transfer(0x30.0x00) (write port E)");
         return URJ_STATUS_FAIL;
@@ -130,7 +144,7 @@ static int
 xpcu_read_cpld_version (struct libusb_device_handle *xpcu, uint16_t *buf)
 {
     if (libusb_control_transfer
-        (xpcu, 0xC0, 0xB0, 0x0050, 0x0001, (unsigned char *) buf, 2, 1000) < 0)
+        (xpcu, 0xC0, 0xB0, 0x0050, 0x0001, (unsigned char *) buf, 2, XPC_TIMEOUT) < 0)
     {
         fprintf(stderr, "libusb_control_transfer(0x50.1) (read_cpld_version)");
         return URJ_STATUS_FAIL;
@@ -144,7 +158,7 @@ static int
 xpcu_read_firmware_version (struct libusb_device_handle *xpcu, uint16_t *buf)
 {
     if (libusb_control_transfer
-        (xpcu, 0xC0, 0xB0, 0x0050, 0x0000, (unsigned char *) buf, 2, 1000) < 0)
+        (xpcu, 0xC0, 0xB0, 0x0050, 0x0000, (unsigned char *) buf, 2, XPC_TIMEOUT) < 0)
     {
         fprintf(stderr, "libusb_control_transfer(0x50.0) (read_firmware_version)");
         return URJ_STATUS_FAIL;
@@ -158,7 +172,7 @@ xpcu_read_firmware_version (struct libusb_device_handle *xpcu, uint16_t *buf)
 static int
 xpcu_select_gpio (struct libusb_device_handle *xpcu, int int_or_ext)
 {
-    if (libusb_control_transfer (xpcu, 0x40, 0xB0, 0x0052, int_or_ext, NULL, 0, 1000)
+    if (libusb_control_transfer (xpcu, 0x40, 0xB0, 0x0052, int_or_ext, NULL, 0, XPC_TIMEOUT)
         < 0)
     {
         fprintf(stderr, "libusb_control_transfer(0x52.x) (select gpio)");
@@ -211,19 +225,44 @@ xpcu_select_gpio (struct libusb_device_handle *xpcu, int int_or_ext)
  *   and if there's only one TDO bit, it arrives as the MSB of the word.
  */
 
-/** @return 0 on success; -1 on error */
+/* Failed transfers of the io_init cable, see io_usb_stats.  */
+static struct io_usb_stats usb_st;
+
+static void
+xpcu_count_error (struct io_usb_stats *st, int ret)
+{
+    if (st == NULL)
+        return;
+    if (ret == LIBUSB_ERROR_TIMEOUT)
+        st->timeouts++;
+    else
+        st->errors++;
+}
+
+/** The TDO read has TIMEOUT ms, the other transfers XPC_TIMEOUT: a
+    request that only completed late would be taken twice by the cable if
+    it was sent again.  Failures are counted in ST if it is not NULL.
+    When the TDO times out, it is waited for again for XPC_TIMEOUT ms
+    since the cable has clocked the bits.
+    @return 0 on success; -1 if the request failed before the cable
+    clocked any bit, so that it can be sent again; -2 on other errors */
 static int
 xpcu_shift (struct libusb_device_handle *xpcu, int bits, uint8_t *in,
-            int out_len, uint8_t *out)
+            int out_len, uint8_t *out, unsigned timeout,
+            struct io_usb_stats *st)
 {
-    int ret, actual;
+    int ret, actual = 0;
     int reqno = 0xA6;
     int in_len = 2 * ((bits + 3) >> 2);
 
-    ret = libusb_control_transfer (xpcu, 0x40, 0xB0, reqno, bits, NULL, 0, 1000);
+    ret = libusb_control_transfer (xpcu, 0x40, 0xB0, reqno, bits, NULL, 0,
+                                   XPC_TIMEOUT);
+    PROBE2 (usb__control, bits, ret);
     if (ret < 0) {
-        fprintf(stderr, "libusb_control_transfer(x.x) (shift)\n");
-        return -1;
+        fprintf(stderr, "libusb_control_transfer(x.x) (shift): %s\n",
+                libusb_error_name(ret));
+        xpcu_count_error (st, ret);
+        return ret == LIBUSB_ERROR_NO_DEVICE ? -2 : -1;
     }
 
 #if VERBOSE
@@ -237,19 +276,35 @@ xpcu_shift (struct libusb_device_handle *xpcu, int bits, uint8_t *in,
     }
 #endif
 
-    ret = libusb_bulk_transfer (xpcu, 0x02, in, in_len, &actual, 1000);
+    ret = libusb_bulk_transfer (xpcu, 0x02, in, in_len, &actual,
+                                XPC_TIMEOUT);
+    PROBE3 (usb__out, in_len, ret, actual);
     if (ret) {
         fprintf(stderr, "usb_bulk_write error(shift): %d (transferred %d)\n",
                           ret, actual);
-        return -1;
+        xpcu_count_error (st, ret);
+        /* The cable has taken the request and waits for these words:
+           it can't be sent again, even if none of them went out.  */
+        return -2;
     }
 
     if (out_len > 0) {
-        ret = libusb_bulk_transfer (xpcu, 0x06 | LIBUSB_ENDPOINT_IN, out, out_len, &actual, 1000);
+        actual = 0;
+        ret = libusb_bulk_transfer (xpcu, 0x06 | LIBUSB_ENDPOINT_IN, out, out_len, &actual, timeout);
+        PROBE3 (usb__in, out_len, ret, actual);
+        if (ret == LIBUSB_ERROR_TIMEOUT && actual == 0
+            && timeout < XPC_TIMEOUT) {
+            xpcu_count_error (st, ret);
+            if (st)
+                st->retries++;
+            ret = libusb_bulk_transfer (xpcu, 0x06 | LIBUSB_ENDPOINT_IN, out, out_len, &actual, XPC_TIMEOUT);
+            PROBE3 (usb__in, out_len, ret, actual);
+        }
         if (ret) {
             fprintf(stderr, "usb_bulk_transfer error(shift): %d %s (transferred %d)\n",
                     ret, libusb_strerror(ret), actual);
-            return -1;
+            xpcu_count_error (st, ret);
+            return -2;
         }
     }
 #if VERBOSE
@@ -266,20 +321,201 @@ xpcu_shift (struct libusb_device_handle *xpcu, int bits, uint8_t *in,
 
 /* ---------------------------------------------------------------------- */
 
-static struct libusb_device_handle *
-io_open_dev (struct libusb_device **devs, unsigned vendor, unsigned product)
+/* Elapsed time, in ms, for the startup timing breakdown printed with -v.  */
+
+static struct
+{
+    double usb_init;
+    double firmware;
+    double enumerate;
+    double open;
+    double cable_init;
+    int loaded;                 /* the firmware was loaded */
+    int warm;                   /* ... or found running */
+} startup;
+
+static double
+ms_since (const struct timespec *t0)
+{
+    struct timespec t1;
+
+    clock_gettime (CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) * 1e3 + (t1.tv_nsec - t0->tv_nsec) / 1e6;
+}
+
+/* ---------------------------------------------------------------------- */
+
+/* === FX2 firmware download ===
+ *
+ *   An unconfigured cable enumerates with the FX2 default product id and
+ *   only understands the Cypress 0xA0 "firmware load" vendor request, which
+ *   writes wLength bytes at address wValue of the 8051 internal RAM.  The
+ *   CPU is held in reset through CPUCS while the image is written; releasing
+ *   it starts the firmware, which disconnects and re-enumerates with the
+ *   configured product id.
+ */
+
+#define FX2_CPUCS 0xE600
+#define FX2_LOAD_CHUNK 1023
+
+static int
+fx2_write_ram (struct libusb_device_handle *fx2, uint16_t addr,
+               uint8_t *data, int len)
+{
+    int r;
+
+    r = libusb_control_transfer (fx2, 0x40, 0xA0, addr, 0, data, len, XPC_TIMEOUT);
+    if (r != len) {
+        fprintf (stderr, "fx2: write of %d bytes at 0x%04x failed (%d)\n",
+                 len, addr, r);
+        return URJ_STATUS_FAIL;
+    }
+    return URJ_STATUS_OK;
+}
+
+static int
+fx2_set_reset (struct libusb_device_handle *fx2, int reset)
+{
+    uint8_t cpucs = reset ? 1 : 0;
+
+    return fx2_write_ram (fx2, FX2_CPUCS, &cpucs, 1);
+}
+
+static int
+hex_byte (const char *p)
+{
+    unsigned v;
+
+    if (sscanf (p, "%2x", &v) != 1)
+        return -1;
+    return v;
+}
+
+/** Upload Intel HEX file PATH into the FX2 RAM.
+    Contiguous records are merged to reduce the number of control transfers.
+    @return 0 on success; -1 on error */
+static int
+fx2_load_hex (struct libusb_device_handle *fx2, const char *path)
+{
+    FILE *f;
+    char line[600];
+    uint8_t buf[FX2_LOAD_CHUNK];
+    unsigned buf_addr = 0;
+    int buf_len = 0;
+    int lineno = 0;
+    int r = URJ_STATUS_OK;
+
+    f = fopen (path, "r");
+    if (f == NULL) {
+        perror (path);
+        return URJ_STATUS_FAIL;
+    }
+
+    if (fx2_set_reset (fx2, 1) != URJ_STATUS_OK) {
+        fclose (f);
+        return URJ_STATUS_FAIL;
+    }
+
+    while (r == URJ_STATUS_OK && fgets (line, sizeof (line), f) != NULL) {
+        int len, addr, type, sum, i;
+        uint8_t data[256];
+
+        lineno++;
+        if (line[0] != ':')
+            continue;
+
+        len = hex_byte (line + 1);
+        addr = (hex_byte (line + 3) << 8) | hex_byte (line + 5);
+        type = hex_byte (line + 7);
+        if (len < 0 || addr < 0 || type < 0 || strlen (line) < 11 + 2 * len) {
+            fprintf (stderr, "%s:%d: malformed record\n", path, lineno);
+            r = URJ_STATUS_FAIL;
+            break;
+        }
+
+        sum = len + (addr >> 8) + (addr & 0xff) + type;
+        for (i = 0; i <= len; i++) {
+            int b = hex_byte (line + 9 + 2 * i);
+            if (b < 0)
+                break;
+            if (i < len)
+                data[i] = b;
+            sum += b;
+        }
+        if (i <= len || (sum & 0xff) != 0) {
+            fprintf (stderr, "%s:%d: bad checksum\n", path, lineno);
+            r = URJ_STATUS_FAIL;
+            break;
+        }
+
+        if (type == 1)
+            break;
+        if (type != 0) {
+            fprintf (stderr, "%s:%d: unsupported record type %d\n",
+                     path, lineno, type);
+            r = URJ_STATUS_FAIL;
+            break;
+        }
+
+        /* Flush if this record does not extend the pending chunk.  */
+        if (buf_len > 0
+            && (buf_addr + buf_len != addr || buf_len + len > FX2_LOAD_CHUNK)) {
+            r = fx2_write_ram (fx2, buf_addr, buf, buf_len);
+            buf_len = 0;
+        }
+        if (buf_len == 0)
+            buf_addr = addr;
+        memcpy (buf + buf_len, data, len);
+        buf_len += len;
+    }
+
+    if (r == URJ_STATUS_OK && buf_len > 0)
+        r = fx2_write_ram (fx2, buf_addr, buf, buf_len);
+
+    fclose (f);
+
+    /* Start the new firmware.  The device disconnects right away, so the
+       status of this last request is not meaningful.  */
+    if (r == URJ_STATUS_OK)
+        fx2_set_reset (fx2, 0);
+
+    return r;
+}
+
+/* ---------------------------------------------------------------------- */
+
+/** @return 1 if the cable already runs its firmware and answers the version
+    requests, in which case the reset and reconfiguration can be skipped. */
+static int
+xpcu_is_ready (struct libusb_device_handle *xpcu)
+{
+    uint16_t fw, cpld;
+
+    if (libusb_claim_interface (xpcu, 0) < 0)
+        return 0;
+
+    if (libusb_control_transfer
+        (xpcu, 0xC0, 0xB0, 0x0050, 0x0000, (unsigned char *) &fw, 2, 100) == 2
+        && libusb_control_transfer
+        (xpcu, 0xC0, 0xB0, 0x0050, 0x0001, (unsigned char *) &cpld, 2, 100) == 2
+        && cpld != 0)
+        return 1;
+
+    libusb_release_interface (xpcu, 0);
+    return 0;
+}
+
+/* ---------------------------------------------------------------------- */
+
+static struct libusb_device *
+io_find_dev (struct libusb_device **devs, unsigned vendor, unsigned product)
 {
   int res;
   unsigned i;
   struct libusb_device *dev;
-  struct libusb_device_handle *hand;
-
-  if (verbose)
-      fprintf (stderr, "Looking for USB %04x:%04x\n", vendor, product);
 
   for (i = 0; ; i++) {
       struct libusb_device_descriptor desc;
-      int iconf;
 
       dev = devs[i];
 
@@ -296,115 +532,163 @@ io_open_dev (struct libusb_device **devs, unsigned vendor, unsigned product)
           fprintf (stderr, "USB %04x:%04x\n",
                    desc.idVendor, desc.idProduct);
 
-      if (desc.idVendor == vendor && desc.idProduct == product)  {
-          res = libusb_open(dev, &hand);
-          if (res != 0) {
-              fprintf(stderr, "usb_open failed (%d)\n", res);
-              return NULL;
-          }
+      if (desc.idVendor == vendor && desc.idProduct == product)
+          return dev;
+  }
 
-          res = libusb_reset_device(hand);
-          if (res != 0) {
-              fprintf(stderr, "usb reset device failed (%d)\n", res);
-              return NULL;
-          }
+  return NULL;
+}
 
-#if 0
-        if (description != NULL) {
-            char string[256];
-            if (libusb_get_string_descriptor(xpcu, dev->descriptor.iProduct,
-                                      string, sizeof(string)) <= 0)
-              {
-                usb_close (xpcu);
-                xpc_error_return(-8,
-                                 "unable to fetch product description");
-              }
-            if (strncmp(string, description, sizeof(string)) != 0)
-              {
-                if (usb_close (xpcu) != 0)
-                  xpc_error_return(-10, "unable to close device");
-                continue;
-              }
-          }
-#endif
+static struct libusb_device_handle *
+io_open_dev (struct libusb_device *dev)
+{
+  int res;
+  int iconf;
+  struct libusb_device_handle *hand;
 
-        res = libusb_get_configuration(hand, &iconf);
-        if (res < 0) {
-            fprintf(stderr,
-                    "io_init: cannot get config descriptor (%d)\n", res);
-            goto error;
-        }
+  res = libusb_open(dev, &hand);
+  if (res != 0) {
+      fprintf(stderr, "usb_open failed (%d)\n", res);
+      return NULL;
+  }
+
+  /* Warm start: the firmware is running and the CPLD answers, so there is
+     no need to reset the device and set its configuration again.  */
+  if (xpcu_is_ready(hand)) {
+      startup.warm = !startup.loaded;
+      return hand;
+  }
+
+  res = libusb_reset_device(hand);
+  if (res != 0) {
+      fprintf(stderr, "usb reset device failed (%d)\n", res);
+      goto error;
+  }
 
 #if 0
-        /* Not working ?? */
+  if (description != NULL) {
+      char string[256];
+      if (libusb_get_string_descriptor(xpcu, dev->descriptor.iProduct,
+                                string, sizeof(string)) <= 0)
         {
-            struct libusb_config_descriptor *conf;
-            res = libusb_get_config_descriptor(dev, 0, &conf);
-            if (res < 0) {
-                fprintf(stderr,
-                        "io_init: cannot get config descriptor (%d)\n", res);
-                goto error;
-            }
-            iconf = conf->bConfigurationValue;
-            libusb_free_config_descriptor(conf);
+          usb_close (xpcu);
+          xpc_error_return(-8,
+                           "unable to fetch product description");
+        }
+      if (strncmp(string, description, sizeof(string)) != 0)
+        {
+          if (usb_close (xpcu) != 0)
+            xpc_error_return(-10, "unable to close device");
+          continue;
         }
+    }
 #endif
 
-        res = libusb_set_configuration (hand, iconf);
-        if (res < 0) {
-            fprintf (stderr, "usb_set_configuration: failed conf %d: %s\n",
-                     iconf, libusb_strerror(res));
-            goto error;
-          }
+  res = libusb_get_configuration(hand, &iconf);
+  if (res < 0) {
+      fprintf(stderr,
+              "io_init: cannot get config descriptor (%d)\n", res);
+      goto error;
+  }
 
-        res = libusb_claim_interface (hand, 0);
-        if (res < 0){
-            fprintf (stderr, "io_init:usb_claim_interface: failed interface 0\n");
-          fprintf (stderr, " %s\n", libusb_strerror(res));
+#if 0
+  /* Not working ?? */
+  {
+      struct libusb_config_descriptor *conf;
+      res = libusb_get_config_descriptor(dev, 0, &conf);
+      if (res < 0) {
+          fprintf(stderr,
+                  "io_init: cannot get config descriptor (%d)\n", res);
           goto error;
-        }
+      }
+      iconf = conf->bConfigurationValue;
+      libusb_free_config_descriptor(conf);
+  }
+#endif
+
+  res = libusb_set_configuration (hand, iconf);
+  if (res < 0) {
+      fprintf (stderr, "usb_set_configuration: failed conf %d: %s\n",
+               iconf, libusb_strerror(res));
+      goto error;
+  }
+
+  res = libusb_claim_interface (hand, 0);
+  if (res < 0){
+      fprintf (stderr, "io_init:usb_claim_interface: failed interface 0\n");
+      fprintf (stderr, " %s\n", libusb_strerror(res));
+      goto error;
+  }
 #if 0
-        int rc = xpcu_read_hid(xpcu);
-        if (rc < 0)
-          {
-            if (rc == -EPIPE)
-              {
-                if (lserial != 0)
-                  {
-                    hint_loadfirmware(dev);
-                    return 0;
-                  }
-              }
-            else
-              fprintf(stderr, "usb_control_msg(0x42.1 %s\n",
-                      usb_strerror());
-          }
-        else
-          if ((lserial != 0) && (lserial != hid))
+  int rc = xpcu_read_hid(xpcu);
+  if (rc < 0)
+    {
+      if (rc == -EPIPE)
+        {
+          if (lserial != 0)
             {
-              usb_close (xpcu);
-              continue;
+              hint_loadfirmware(dev);
+              return 0;
             }
-#endif
-        return hand;
+        }
+      else
+        fprintf(stderr, "usb_control_msg(0x42.1 %s\n",
+                usb_strerror());
+    }
+  else
+    if ((lserial != 0) && (lserial != hid))
+      {
+        usb_close (xpcu);
+        continue;
       }
-  }
+#endif
 
-  // device not found
-  fprintf(stderr, "No USB probe found\n");
-  return NULL;
+  return hand;
 
 error:
   libusb_close (hand);
   return NULL;
 }
 
+/* Upload FIRMWARE into the unconfigured cable DEV.  */
+
+static int
+io_load_firmware (struct libusb_device *dev, const char *firmware)
+{
+  int res;
+  struct libusb_device_handle *hand;
+
+  if (verbose)
+      fprintf (stderr, "Loading firmware %s\n", firmware);
+
+  res = libusb_open(dev, &hand);
+  if (res != 0) {
+      fprintf(stderr, "usb_open failed (%d)\n", res);
+      return -1;
+  }
+
+  res = fx2_load_hex(hand, firmware);
+
+  libusb_close (hand);
+  return res;
+}
+
+/* Number of device list polls, 20 ms apart, while the cable re-enumerates
+   after its firmware was started.  */
+#define XPC_ENUM_POLLS 500
+
 static struct libusb_device_handle *
-io_open (unsigned vendor, unsigned product)
+io_open (unsigned vendor, unsigned product, const char *firmware)
 {
   int cnt;
+  int poll;
   struct libusb_device **devs;
+  struct libusb_device *dev;
   struct libusb_device_handle *hand;
+  struct timespec t0;
+
+  if (verbose)
+      fprintf (stderr, "Looking for USB %04x:%04x\n", vendor, product);
 
   cnt = libusb_get_device_list(NULL, &devs);
   if (cnt < 0) {
@@ -412,7 +696,55 @@ io_open (unsigned vendor, unsigned product)
     return NULL;
   }
 
-  hand = io_open_dev(devs, vendor, product);
+  dev = io_find_dev(devs, vendor, product);
+
+  if (dev == NULL && vendor == VENDOR_ID) {
+      /* Maybe the cable is there but without its firmware.  */
+      struct libusb_device *fx2 = io_find_dev(devs, vendor, FX2_PRODUCT_ID);
+
+      if (fx2 != NULL) {
+          if (firmware == NULL) {
+              fprintf (stderr, "USB %04x:%04x needs its firmware, "
+                       "use -f xusb_xp2.hex\n", vendor, FX2_PRODUCT_ID);
+              libusb_free_device_list(devs, 1);
+              return NULL;
+          }
+
+          clock_gettime (CLOCK_MONOTONIC, &t0);
+          if (io_load_firmware(fx2, firmware) != 0) {
+              libusb_free_device_list(devs, 1);
+              return NULL;
+          }
+          startup.firmware = ms_since (&t0);
+          startup.loaded = 1;
+
+          /* Wait for the re-enumeration.  */
+          clock_gettime (CLOCK_MONOTONIC, &t0);
+          for (poll = 0; dev == NULL && poll < XPC_ENUM_POLLS; poll++) {
+              libusb_free_device_list(devs, 1);
+              usleep (20000);
+              cnt = libusb_get_device_list(NULL, &devs);
+              if (cnt < 0) {
+                  fprintf (stderr, "libusb: cannot get device list (%d)\n",
+                           cnt);
+                  return NULL;
+              }
+              dev = io_find_dev(devs, vendor, product);
+          }
+          startup.enumerate = ms_since (&t0);
+      }
+  }
+
+  if (dev == NULL) {
+      // device not found
+      fprintf(stderr, "No USB probe found\n");
+      libusb_free_device_list(devs, 1);
+      return NULL;
+  }
+
+  clock_gettime (CLOCK_MONOTONIC, &t0);
+  hand = io_open_dev(dev);
+  startup.open = ms_since (&t0);
 
   libusb_free_device_list(devs, 1);
 
@@ -421,27 +753,13 @@ io_open (unsigned vendor, unsigned product)
 
 struct libusb_device_handle *global_xpcu;
 
+/* Check the firmware and CPLD of the cable just opened.  */
+
 static int
-xpcu_common_init (unsigned vendor, unsigned product, const char *desc)
+xpcu_cable_init (struct libusb_device_handle *xpcu)
 {
     int r;
     uint16_t buf;
-    struct libusb_device_handle *xpcu;
-
-    r = libusb_init(NULL);
-    if (r < 0) {
-        fprintf (stderr, "libusb: cannot initialize (%d)\n", r);
-        return -1;
-    }
-
-    xpcu = io_open(vendor, product);
-
-    if (xpcu == NULL) {
-        libusb_exit(NULL);
-        return -1;
-    }
-
-    global_xpcu = xpcu;
 
     r = xpcu_request_28 (xpcu, 0x11);
     if (r != URJ_STATUS_FAIL)
@@ -470,17 +788,49 @@ xpcu_common_init (unsigned vendor, unsigned product, const char *desc)
         }
     }
 
+    return r;
+}
+
+static int
+xpcu_common_init (unsigned vendor, unsigned product, const char *desc,
+                  const char *firmware)
+{
+    int r;
+    struct libusb_device_handle *xpcu;
+    struct timespec t0;
+
+    memset (&startup, 0, sizeof (startup));
+    clock_gettime (CLOCK_MONOTONIC, &t0);
+    r = libusb_init(NULL);
+    if (r < 0) {
+        fprintf (stderr, "libusb: cannot initialize (%d)\n", r);
+        return -1;
+    }
+    startup.usb_init = ms_since (&t0);
+
+    xpcu = io_open(vendor, product, firmware);
+
+    if (xpcu == NULL) {
+        libusb_exit(NULL);
+        return -1;
+    }
+
+    clock_gettime (CLOCK_MONOTONIC, &t0);
+
+    global_xpcu = xpcu;
+
+    r = xpcu_cable_init (xpcu);
     if (r != URJ_STATUS_OK)
         libusb_close (xpcu);
 
+    startup.cable_init = ms_since (&t0);
+
     return r;
 }
 
 static int
-xpc_int_init (void)
+xpc_int_init (struct libusb_device_handle *xpcu)
 {
-    struct libusb_device_handle *xpcu = global_xpcu;
-
     if (xpcu_select_gpio (xpcu, 0) == URJ_STATUS_FAIL)
         return URJ_STATUS_FAIL;
 
@@ -488,9 +838,8 @@ xpc_int_init (void)
 }
 
 static int
-xpc_ext_init (void)
+xpc_ext_init (struct libusb_device_handle *xpcu)
 {
-    struct libusb_device_handle *xpcu = global_xpcu;
     uint8_t zero[2] = { 0, 0 };
     int r;
 
@@ -500,7 +849,7 @@ xpc_ext_init (void)
     if (r == URJ_STATUS_OK)
         r = xpcu_output_enable (xpcu, 1);
     if (r == URJ_STATUS_OK)
-        r = xpcu_shift (xpcu, 2, zero, 0, NULL) == -1
+        r = xpcu_shift (xpcu, 2, zero, 0, NULL, XPC_TIMEOUT, NULL) != 0
             ? URJ_STATUS_FAIL : URJ_STATUS_OK;
     if (r == URJ_STATUS_OK)
         r = xpcu_request_28 (xpcu, 0x12);
@@ -508,24 +857,86 @@ xpc_ext_init (void)
     return r;
 }
 
+/* Hotplug.  The open cable leaving is counted, so that the application
+   can open it again and rediscover the chain (io_changed).  Other cables
+   of our vendor coming and going are ignored.  */
+
+static int hotplug_events;
+static int hotplug_registered;
+static libusb_hotplug_callback_handle hotplug_handle;
+
+static int LIBUSB_CALL
+io_hotplug (libusb_context *ctx, libusb_device *dev,
+            libusb_hotplug_event event, void *arg)
+{
+    if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT && global_xpcu
+        && dev == libusb_get_device (global_xpcu))
+        hotplug_events++;
+    return 0;
+}
+
+static void
+io_hotplug_register (unsigned vendor)
+{
+    if (!libusb_has_capability (LIBUSB_CAP_HAS_HOTPLUG))
+        return;
+    if (libusb_hotplug_register_callback (NULL,
+            LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, LIBUSB_HOTPLUG_NO_FLAGS,
+            vendor, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+            io_hotplug, NULL, &hotplug_handle) == LIBUSB_SUCCESS)
+        hotplug_registered = 1;
+}
+
+/** @return 1 if the open cable was unplugged since the last call, or
+    if there is no cable open */
+int
+io_changed (void)
+{
+    struct timeval tv = { 0, 0 };
+    int n;
+
+    if (global_xpcu == NULL)
+        return 1;
+    if (hotplug_registered)
+        libusb_handle_events_timeout_completed (NULL, &tv, NULL);
+    n = hotplug_events;
+    hotplug_events = 0;
+    return n > 0;
+}
+
 int
-io_init (unsigned vendor, unsigned product, const char *desc)
+io_init (unsigned vendor, unsigned product, const char *desc,
+         const char *firmware)
 {
     int r;
+    struct timespec t0;
 
-    r = xpcu_common_init (vendor, product, desc);
+    r = xpcu_common_init (vendor, product, desc, firmware);
     if (r == URJ_STATUS_FAIL)
         return r;
 
+    clock_gettime (CLOCK_MONOTONIC, &t0);
     if (1)
-        r = xpc_ext_init();
+        r = xpc_ext_init (global_xpcu);
     else
-        r = xpc_int_init();
+        r = xpc_int_init (global_xpcu);
+    startup.cable_init += ms_since (&t0);
+
+    if (verbose && r == URJ_STATUS_OK)
+        fprintf (stderr, "startup (%s): usb init %.1f ms, firmware %.1f ms, "
+                 "enumeration %.1f ms, open %.1f ms, cable init %.1f ms\n",
+                 startup.warm ? "warm" : "cold", startup.usb_init,
+                 startup.firmware, startup.enumerate, startup.open,
+                 startup.cable_init);
 
     if (r != URJ_STATUS_OK) {
         libusb_close (global_xpcu);
         libusb_exit(NULL);
         global_xpcu = NULL;
+    } else {
+        /* The firmware load re-enumerates the cable: register after.  */
+        io_hotplug_register (vendor);
+        hotplug_events = 0;
     }
 
     return r;
@@ -533,144 +944,582 @@ io_init (unsigned vendor, unsigned product, const char *desc)
 
 /* ---------------------------------------------------------------------- */
 
-/* 16-bit words. More than 4 currently leads to bit errors; 13 to serious problems */
-#define XPC_A6_CHUNKSIZE 4
+/* Shift requests sent to the cable of io_init, and those that read TDO.  */
+unsigned long io_transfers, io_tdo_transfers;
+
+/* Adaptive timeout.  The shift requests of the io_init cable that read
+   TDO are timed in a histogram, by powers of two of microseconds.  From
+   XPC_TIMEOUT_SAMPLES requests on, the TDO read waits XPC_TIMEOUT_P99
+   times the 99th percentile, within XPC_TIMEOUT_MIN and XPC_TIMEOUT ms,
+   so that a stalled endpoint is noticed in a few ms; the TDO is then
+   waited for again with the full timeout.  The control request and the
+   bulk OUT keep the full timeout, since they can't tell a late request
+   from a lost one.  The other cables (broadcast) use the full timeout
+   and aren't counted.  */
+
+#define XPC_TIMEOUT_MIN 5
+#define XPC_TIMEOUT_P99 8
+#define XPC_TIMEOUT_SAMPLES 256
+#define XPC_RETRIES 3
+
+static struct
+{
+    unsigned hist[32];
+    unsigned samples;
+    unsigned timeout;           /* ms, 0 until there are enough samples */
+} latency;
+
+/* Timeout of the TDO read.  */
+static unsigned
+xpcu_timeout (struct libusb_device_handle *xpcu)
+{
+    if (xpcu != global_xpcu || latency.timeout == 0)
+        return XPC_TIMEOUT;
+    return latency.timeout;
+}
 
-typedef struct
+static void
+xpcu_time (const struct timespec *t0)
 {
-    struct libusb_device_handle *xpcu;
-    int in_bits;
-    int out_bits;
-    int out_done;
-    uint8_t *out;
-    uint8_t buf[XPC_A6_CHUNKSIZE * 2];
+    unsigned *hist = latency.hist;
+    unsigned *samples = &latency.samples;
+    double us = ms_since (t0) * 1000, ms;
+    unsigned n = 0;
+    int k;
+
+    for (k = 0; k < 31 && us >= 2u << k; k++)
+        ;
+    hist[k]++;
+    if (++*samples < XPC_TIMEOUT_SAMPLES || *samples % 64 != 0)
+        return;
+
+    /* Upper bound of the bucket holding the 99th percentile.  */
+    for (k = 0; k < 31; k++) {
+        n += hist[k];
+        if (n * 100ull >= *samples * 99ull)
+            break;
+    }
+    ms = (2u << k) / 1000.0 * XPC_TIMEOUT_P99;
+    if (ms < XPC_TIMEOUT_MIN)
+        ms = XPC_TIMEOUT_MIN;
+    if (ms > XPC_TIMEOUT)
+        ms = XPC_TIMEOUT;
+    latency.timeout = ms;
+
+    /* Age the histogram, to follow the load of the bus.  */
+    if (*samples >= 1u << 16) {
+        *samples = 0;
+        for (k = 0; k < 32; k++) {
+            hist[k] /= 2;
+            *samples += hist[k];
+        }
+    }
 }
-xpc_ext_transfer_state_t;
 
-/* ---------------------------------------------------------------------- */
+/* After a failed request: clear the halts and drop the TDO that the
+   cable may still send.  */
+static void
+xpcu_recover (struct libusb_device_handle *xpcu)
+{
+    uint8_t buf[512];
+    int actual;
+
+    libusb_clear_halt (xpcu, 0x02);
+    libusb_clear_halt (xpcu, 0x06 | LIBUSB_ENDPOINT_IN);
+    while (libusb_bulk_transfer (xpcu, 0x06 | LIBUSB_ENDPOINT_IN, buf,
+                                 sizeof (buf), &actual, XPC_TIMEOUT_MIN) == 0
+           && actual > 0)
+        ;
+}
 
 /** @return 0 on success; -1 on error */
 static int
-xpcu_do_ext_transfer (xpc_ext_transfer_state_t *xts)
+xpcu_do_ext_transfer (xpc_ext_transfer_state_t *xts, void *arg)
 {
     int r;
     int out_len;
+    struct libusb_device_handle *xpcu = arg;
+    /* The followers run in their own threads: they leave usb_st and the
+       latency histogram, which belong to the leader, alone.  */
+    struct io_usb_stats *st = xpcu == global_xpcu ? &usb_st : NULL;
+    int read_tdo, try;
 
     out_len = 2 * ((xts->out_bits + 15) >> 4);
+    read_tdo = out_len > 0;
+
+    for (try = 0; ; try++) {
+        unsigned long timeouts = st ? st->timeouts : 0;
+        struct timespec t0;
+
+        clock_gettime (CLOCK_MONOTONIC, &t0);
+        r = xpcu_shift (xpcu, xts->in_bits, xts->buf, out_len, xts->buf,
+                        try ? XPC_TIMEOUT : xpcu_timeout (xpcu), st);
+        if (r == 0) {
+            /* Time the requests that went through at once only.  */
+            if (st && read_tdo && st->timeouts == timeouts)
+                xpcu_time (&t0);
+            break;
+        }
+        xpcu_recover (xpcu);
+        if (r == -2 || try == XPC_RETRIES) {
+            if (st)
+                st->lost++;
+            r = -1;
+            break;
+        }
+        if (st)
+            st->retries++;
+    }
+    if (st) {
+        io_transfers++;
+        if (out_len > 0)
+            io_tdo_transfers++;
+    }
+
+    if (r == 0)
+        xpcu_unpack_tdo (xts, xts->buf);
 
-    r = xpcu_shift (xts->xpcu, xts->in_bits, xts->buf, out_len, xts->buf);
+    xts->in_bits = 0;
+    xts->out_bits = 0;
 
-    if (r == 0) {
-        int out_idx = 0;
-        int out_rem = xts->out_bits;
+    return r;
+}
 
-        while (out_rem > 0)
-        {
-            uint32_t mask, rxw;
+/* ---------------------------------------------------------------------- */
 
-            rxw = (xts->buf[out_idx + 1] << 8) | xts->buf[out_idx];
+#if XPC_MAX_CHUNK != XPC_A6_OUT_CHUNKSIZE
+#error "XPC_MAX_CHUNK must match XPC_A6_OUT_CHUNKSIZE"
+#endif
 
-            /* In the last (incomplete) word, the data isn't shifted completely to LSB */
+/* Chunk size, in 16-bit words, of the transfers that don't read TDO;
+   0 selects XPC_A6_OUT_CHUNKSIZE during a configuration download and
+   XPC_A6_CHUNKSIZE otherwise.  */
+unsigned out_chunk;
 
-            mask = (out_rem >= 16) ? 1 : (1 << (16 - out_rem));
+static int downloading;
 
-            while (mask <= (1 << 15) && out_rem > 0)
-            {
-                unsigned last_tdo = (rxw & mask) ? 1 : 0;
-                if ((xts->out_done & 7) == 0)
-                    xts->out[xts->out_done >> 3] = last_tdo;
-                else
-                    xts->out[xts->out_done >> 3] |= last_tdo << (xts->out_done & 7);
-                xts->out_done++;
-                mask <<= 1;
-                out_rem--;
-            }
+void
+io_download (int on)
+{
+    downloading = on;
+}
 
-            out_idx += 2;
+static unsigned
+chunk (void)
+{
+    if (out_chunk)
+        return out_chunk;
+    return downloading ? XPC_A6_OUT_CHUNKSIZE : XPC_A6_CHUNKSIZE;
+}
+
+/* ---------------------------------------------------------------------- */
+
+/* Broadcast.  The cable opened by io_init leads; the followers opened by
+   io_broadcast_init each have a worker thread that shifts the same scans
+   on its cable, as a batch, while the leader shifts them.  The TDO of
+   the leader is returned, that of the followers is compared with it.  A
+   follower that fails is dropped.  */
+
+struct xpc_follower
+{
+    struct libusb_device_handle *xpcu;
+    pthread_t thread;
+    struct xpc_scan *scans;
+    int scans_size;
+    uint8_t *tdo;
+    unsigned tdo_size;
+    int result;
+    struct io_cable_stats st;
+};
+
+static struct xpc_follower followers[XPC_MAX_CABLES - 1];
+static int nfollowers;
+
+static pthread_mutex_t bc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bc_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t bc_done = PTHREAD_COND_INITIALIZER;
+static unsigned bc_generation;
+static int bc_pending;
+static int bc_quit;
+static struct xpc_scan *bc_scans;
+static int bc_count;
+
+static struct io_cable_stats leader_st;
+
+/* Shift the current job on follower C, into its own TDO buffer.  */
+
+static int
+bc_run (struct xpc_follower *c)
+{
+    unsigned tdo_bytes = 0;
+    int k;
+
+    if (bc_count > c->scans_size) {
+        struct xpc_scan *p = realloc (c->scans, bc_count * sizeof (*p));
+        if (p == NULL)
+            return -1;
+        c->scans = p;
+        c->scans_size = bc_count;
+    }
+    for (k = 0; k < bc_count; k++)
+        if (bc_scans[k].tdo != NULL)
+            tdo_bytes += (bc_scans[k].len + 7) / 8;
+    if (tdo_bytes > c->tdo_size) {
+        uint8_t *p = realloc (c->tdo, tdo_bytes);
+        if (p == NULL)
+            return -1;
+        c->tdo = p;
+        c->tdo_size = tdo_bytes;
+    }
+
+    tdo_bytes = 0;
+    for (k = 0; k < bc_count; k++) {
+        c->scans[k] = bc_scans[k];
+        if (bc_scans[k].tdo != NULL) {
+            c->scans[k].tdo = c->tdo + tdo_bytes;
+            tdo_bytes += (bc_scans[k].len + 7) / 8;
         }
     }
 
-    xts->in_bits = 0;
-    xts->out_bits = 0;
+    return xpcu_scan_batch (c->scans, bc_count, chunk (),
+                            xpcu_do_ext_transfer, c->xpcu, NULL, NULL);
+}
 
-    return r;
+static void *
+bc_worker (void *arg)
+{
+    struct xpc_follower *c = arg;
+    unsigned generation = 0;
+
+    for (;;) {
+        pthread_mutex_lock (&bc_lock);
+        while (bc_generation == generation && !bc_quit)
+            pthread_cond_wait (&bc_start, &bc_lock);
+        generation = bc_generation;
+        if (bc_quit) {
+            pthread_mutex_unlock (&bc_lock);
+            return NULL;
+        }
+        pthread_mutex_unlock (&bc_lock);
+
+        if (!c->st.failed)
+            c->result = bc_run (c);
+
+        pthread_mutex_lock (&bc_lock);
+        if (--bc_pending == 0)
+            pthread_cond_signal (&bc_done);
+        pthread_mutex_unlock (&bc_lock);
+    }
 }
 
-/* ---------------------------------------------------------------------- */
+static void
+bc_post (struct xpc_scan *scans, int count)
+{
+    pthread_mutex_lock (&bc_lock);
+    bc_scans = scans;
+    bc_count = count;
+    bc_pending = nfollowers;
+    bc_generation++;
+    pthread_cond_broadcast (&bc_start);
+    pthread_mutex_unlock (&bc_lock);
+}
+
+/* Wait for the followers and compare their TDO with that of the leader,
+   whose scans returned R.  */
 
 static void
-xpcu_add_bit_for_ext_transfer (xpc_ext_transfer_state_t *xts,
-                               unsigned tdi, unsigned tms,
-                               int is_real)
+bc_wait (int r)
 {
-    int bit_idx = (xts->in_bits & 3);
-    int buf_idx = (xts->in_bits - bit_idx) >> 1;
+    int i, k;
+
+    pthread_mutex_lock (&bc_lock);
+    while (bc_pending > 0)
+        pthread_cond_wait (&bc_done, &bc_lock);
+    pthread_mutex_unlock (&bc_lock);
+
+    if (r < 0)
+        leader_st.errors++;
+    else
+        leader_st.scans++;
+    for (i = 0; i < nfollowers; i++) {
+        struct xpc_follower *c = &followers[i];
+        unsigned off = 0;
+        int mismatch = 0;
+
+        if (c->st.failed)
+            continue;
+        if (c->result < 0) {
+            c->st.errors++;
+            c->st.failed = 1;
+            fprintf (stderr, "cable %d: transfer failed, dropped\n", i + 1);
+            continue;
+        }
+        c->st.scans++;
+        if (r < 0)
+            continue;
+        for (k = 0; k < bc_count; k++) {
+            unsigned n = (bc_scans[k].len + 7) / 8;
+
+            if (bc_scans[k].tdo == NULL || n == 0)
+                continue;
+            if (memcmp (bc_scans[k].tdo, c->tdo + off, n - 1) != 0
+                || ((bc_scans[k].tdo[n - 1] ^ c->tdo[off + n - 1])
+                    & (0xff >> ((8 - bc_scans[k].len % 8) % 8))))
+                mismatch = 1;
+            off += n;
+        }
+        if (mismatch) {
+            if (c->st.mismatches++ == 0)
+                fprintf (stderr, "cable %d: TDO differs from cable 0 "
+                         "(scan %u)\n", i + 1, c->st.scans);
+        }
+    }
+}
 
-    if (bit_idx == 0) {
-        /* Clear for the next chunk. */
-        xts->buf[buf_idx] = 0;
-        xts->buf[buf_idx + 1] = 0;
+static void
+bc_close (void)
+{
+    int i;
+
+    pthread_mutex_lock (&bc_lock);
+    bc_quit = 1;
+    pthread_cond_broadcast (&bc_start);
+    pthread_mutex_unlock (&bc_lock);
+
+    for (i = 0; i < nfollowers; i++) {
+        pthread_join (followers[i].thread, NULL);
+        libusb_close (followers[i].xpcu);
+        free (followers[i].scans);
+        free (followers[i].tdo);
     }
+    memset (followers, 0, sizeof (followers));
+    nfollowers = 0;
+    bc_quit = 0;
+}
 
-    xts->in_bits++;
+/* Open the cables of VENDOR:PRODUCT other than the leader, loading
+   FIRMWARE first into the unconfigured ones, until there are COUNT
+   cables in all.  Missing cables are left out with a warning, like
+   those dropped when they fail.
+   @return 0 on success; -1 on error */
+int
+io_broadcast_init (unsigned vendor, unsigned product, const char *firmware,
+                   int count)
+{
+    struct libusb_device **devs;
+    struct libusb_device *leader = libusb_get_device (global_xpcu);
+    int cnt, i, poll;
 
-    if (is_real)
-    {
-        xts->buf[buf_idx] |= ((tms << 4) | tdi) << bit_idx;
-        xts->buf[buf_idx + 1] |= (0x11 << bit_idx);
-        xts->out_bits++;
+    if (count > XPC_MAX_CABLES) {
+        fprintf (stderr, "at most %d cables\n", XPC_MAX_CABLES);
+        return -1;
     }
+
+    if (firmware != NULL && vendor == VENDOR_ID) {
+        cnt = libusb_get_device_list (NULL, &devs);
+        for (i = 0; i < cnt; i++) {
+            struct libusb_device_descriptor desc;
+
+            if (libusb_get_device_descriptor (devs[i], &desc) == 0
+                && desc.idVendor == vendor
+                && desc.idProduct == FX2_PRODUCT_ID)
+                io_load_firmware (devs[i], firmware);
+        }
+        if (cnt >= 0)
+            libusb_free_device_list (devs, 1);
+    }
+
+    for (poll = 0; nfollowers + 1 < count && poll < XPC_ENUM_POLLS;
+         poll++) {
+        if (poll)
+            usleep (20000);
+        cnt = libusb_get_device_list (NULL, &devs);
+        if (cnt < 0) {
+            fprintf (stderr, "libusb: cannot get device list (%d)\n", cnt);
+            return -1;
+        }
+
+        for (i = 0; i < cnt && nfollowers + 1 < count; i++) {
+            struct libusb_device_descriptor desc;
+            struct xpc_follower *c = &followers[nfollowers];
+            int j;
+
+            if (devs[i] == leader
+                || libusb_get_device_descriptor (devs[i], &desc) < 0
+                || desc.idVendor != vendor || desc.idProduct != product)
+                continue;
+            for (j = 0; j < nfollowers; j++)
+                if (libusb_get_device (followers[j].xpcu) == devs[i])
+                    break;
+            if (j < nfollowers)
+                continue;
+
+            c->xpcu = io_open_dev (devs[i]);
+            if (c->xpcu == NULL)
+                continue;
+            if (xpcu_cable_init (c->xpcu) != URJ_STATUS_OK
+                || xpc_ext_init (c->xpcu) != URJ_STATUS_OK) {
+                libusb_close (c->xpcu);
+                continue;
+            }
+            if (pthread_create (&c->thread, NULL, bc_worker, c) != 0) {
+                perror ("pthread_create");
+                libusb_close (c->xpcu);
+                break;
+            }
+            if (verbose)
+                fprintf (stderr, "cable %d: bus %d address %d\n",
+                         nfollowers + 1, libusb_get_bus_number (devs[i]),
+                         libusb_get_device_address (devs[i]));
+            nfollowers++;
+        }
+        libusb_free_device_list (devs, 1);
+    }
+
+    if (nfollowers + 1 < count)
+        fprintf (stderr, "warning: found %d cables, %d wanted\n",
+                 nfollowers + 1, count);
+
+    /* The firmware loads re-enumerate cables: forget their events.  */
+    if (hotplug_registered) {
+        struct timeval tv = { 0, 0 };
+
+        libusb_handle_events_timeout_completed (NULL, &tv, NULL);
+    }
+    hotplug_events = 0;
+    return 0;
+}
+
+/** Counters of the transfers of the io_init cable.  */
+void
+io_usb_stats (struct io_usb_stats *st)
+{
+    *st = usb_st;
+    st->timeout_ms[0] = XPC_TIMEOUT;
+    st->timeout_ms[1] = xpcu_timeout (global_xpcu);
+}
+
+/** Counters of cable I, 0 being the leader.
+    @return 0; -1 if there is no such cable */
+int
+io_cable_stats (int i, struct io_cable_stats *st)
+{
+    if (i < 0 || i > nfollowers || global_xpcu == NULL)
+        return -1;
+    *st = i ? followers[i - 1].st : leader_st;
+    return 0;
 }
 
 /* ---------------------------------------------------------------------- */
 
+/* Shift on the leader, and on the followers if broadcasting.  */
+static int
+scan_bits (const unsigned char *tdi, const unsigned char *tms,
+           unsigned char *tdo, unsigned len)
+{
+    struct xpc_scan scan = { tms, tdi, tdo, len };
+    int r;
+
+    if (nfollowers)
+        bc_post (&scan, 1);
+    if (tdo == NULL)
+        r = xpcu_scan_bits_out (tdi, tms, len, chunk (),
+                                xpcu_do_ext_transfer, global_xpcu);
+    else
+        r = xpcu_scan_bits (tdi, tms, tdo, len,
+                            xpcu_do_ext_transfer, global_xpcu);
+    if (nfollowers)
+        bc_wait (r);
+    return r;
+}
+
 // @@@@ RFHH the specx say that it should be
 //      @return: num clocks on success, -1 on error.
 //              Might have to be: return i;
 
-/** @return 0 on success; -1 on error */
+/** TDO may be NULL if it is not needed, in which case it is not read from
+    the cable and larger transfers are used.
+    @return 0 on success; -1 on error */
 int
 io_scan(const unsigned char *tdi, const unsigned char *tms,
         unsigned char *tdo, unsigned len)
 {
-    unsigned i;
-    int res;
-    xpc_ext_transfer_state_t xts;
-
-    /* Initialize state.  */
-    xts.xpcu = global_xpcu;
-    xts.out = (uint8_t *) tdo;
-    xts.in_bits = 0;
-    xts.out_bits = 0;
-    xts.out_done = 0;
-
-    for (i = 0; i < len; i++) {
-        unsigned di = (tdi[i >> 3] >> (i & 7)) & 1;
-        unsigned tm = (tms[i >> 3] >> (i & 7)) & 1;
-        xpcu_add_bit_for_ext_transfer (&xts, di, tm, 1);
-        if (xts.in_bits == (4 * XPC_A6_CHUNKSIZE - 1)) {
-            res = xpcu_do_ext_transfer (&xts);
-            if (res < 0)
-                return -1;
-        }
-    }
+    int r;
 
-    if (xts.in_bits > 0) {
-        /* CPLD doesn't like multiples of 4; add one dummy bit */
-        if ((xts.in_bits & 3) == 0)
-            xpcu_add_bit_for_ext_transfer (&xts, 0, 0, 0);
-        res = xpcu_do_ext_transfer (&xts);
-        if (res < 0)
-            return -1;
-    }
+    PROBE2 (scan__start, len, tdo != NULL);
+    r = scan_bits (tdi, tms, tdo, len);
+    PROBE2 (scan__done, len, r);
+    return r;
+}
+
+static xpc_stream_state_t stream;
 
+int
+io_scan_begin(const unsigned char *tms, unsigned char *tdo, unsigned len)
+{
+    PROBE2 (scan__start, len, tdo != NULL);
+    xpcu_stream_begin (&stream, tms, tdo, len, chunk ());
     return 0;
 }
 
+/** @return number of TDO bits stored; -1 on error */
+int
+io_scan_feed(const unsigned char *tdi, unsigned avail)
+{
+    int r;
+
+    /* Broadcast: the followers need the whole vector.  */
+    if (nfollowers) {
+        if (avail < stream.len)
+            return 0;
+        r = scan_bits (tdi, stream.tms,
+                       stream.read_tdo ? stream.xts.out : NULL, stream.len);
+        if (r == 0)
+            r = stream.len;
+        stream.pos = stream.len;
+    } else
+        r = xpcu_stream_feed (&stream, tdi, avail,
+                              xpcu_do_ext_transfer, global_xpcu);
+
+    if (r < 0 || stream.pos == stream.len)
+        PROBE2 (scan__done, stream.len, r < 0 ? r : 0);
+    return r;
+}
+
+/** @return 0 on success; -1 on error */
+int
+io_scan_batch_cb(struct xpc_scan *scans, int count,
+                 xpc_scan_done_fn done, void *arg)
+{
+    int r;
+
+    PROBE1 (batch__start, count);
+    if (nfollowers)
+        bc_post (scans, count);
+    r = xpcu_scan_batch (scans, count, chunk (),
+                         xpcu_do_ext_transfer, global_xpcu, done, arg);
+    if (nfollowers)
+        bc_wait (r);
+    PROBE2 (batch__done, count, r);
+    return r;
+}
+
+int
+io_scan_batch(struct xpc_scan *scans, int count)
+{
+    return io_scan_batch_cb (scans, count, NULL, NULL);
+}
+
 void
 io_close(void)
 {
     if (global_xpcu) {
+        bc_close ();
+        memset (&leader_st, 0, sizeof (leader_st));
+        memset (&latency, 0, sizeof (latency));
+        if (hotplug_registered)
+            libusb_hotplug_deregister_callback (NULL, hotplug_handle);
+        hotplug_registered = 0;
         libusb_close (global_xpcu);
         libusb_exit(NULL);
         global_xpcu = NULL;
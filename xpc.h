@@ -1,12 +1,101 @@
 #define VENDOR_ID 0x03FD
 #define PRODUCT_ID 0x0008
 
-int io_init(unsigned vendor, unsigned product, const char *desc);
+/* Product id of the cable before its firmware is loaded.  */
+#define FX2_PRODUCT_ID 0x0013
+
+int io_init(unsigned vendor, unsigned product, const char *desc,
+            const char *firmware);
 
 int io_scan(const unsigned char *tdi, const unsigned char *tms,
             unsigned char *tdo, unsigned len);
+
+/* One vector of a batch.  TDO is NULL if it is not needed.  */
+struct xpc_scan
+{
+    const unsigned char *tms;
+    const unsigned char *tdi;
+    unsigned char *tdo;
+    unsigned len;
+};
+
+typedef void (*xpc_scan_done_fn) (struct xpc_scan *scan, void *arg);
+
+/* Shift the COUNT vectors of SCANS back to back, as one stream of cable
+   transfers, and store the TDO of each in its descriptor.  Runs of
+   vectors that don't need TDO go in the large transfers.  */
+int io_scan_batch(struct xpc_scan *scans, int count);
+
+/* Same, calling DONE with ARG for each vector as soon as it has been
+   shifted and its TDO stored, in order.  */
+int io_scan_batch_cb(struct xpc_scan *scans, int count,
+                     xpc_scan_done_fn done, void *arg);
+
+/* Cut-through scan of LEN bits, for TDI arriving piecewise: the TMS
+   vector is complete, TDO may be NULL.  io_scan_feed is then called
+   with TDI holding the first AVAIL bits, AVAIL growing up to LEN; it
+   shifts what it can and returns the number of bits final in TDO, or
+   -1 on error.  The vector is complete when AVAIL reaches LEN.  */
+int io_scan_begin(const unsigned char *tms, unsigned char *tdo,
+                  unsigned len);
+int io_scan_feed(const unsigned char *tdi, unsigned avail);
+
+/* Broadcast: open more cables of VENDOR:PRODUCT, COUNT in all with the
+   one of io_init, loading FIRMWARE into those that need it.  Every scan
+   is then shifted on all of them in parallel; the TDO of the first
+   (leader) cable is returned and the others are checked against it.
+   Cables that can't be found are left out with a warning.  */
+#define XPC_MAX_CABLES 64
+
+int io_broadcast_init(unsigned vendor, unsigned product,
+                      const char *firmware, int count);
+
+struct io_cable_stats
+{
+    unsigned scans;
+    unsigned mismatches;    /* scans whose TDO differs from the leader */
+    unsigned errors;
+    int failed;             /* dropped after an error */
+};
+
+/* Counters of cable I, 0 being the leader.  Return -1 past the last.  */
+int io_cable_stats(int i, struct io_cable_stats *st);
+
+/* Transfers of the io_init cable that failed.  Requests that fail before
+   the cable clocked any bit are sent again; the others are lost, and
+   io_scan returns -1 with the TAP in an unknown state.  */
+struct io_usb_stats
+{
+    unsigned long timeouts;
+    unsigned long errors;       /* other than timeouts */
+    unsigned long retries;
+    unsigned long lost;
+    unsigned timeout_ms[2];     /* current timeouts, without and with TDO */
+};
+
+void io_usb_stats(struct io_usb_stats *st);
+
+/* Return 1 if the open cable was unplugged since the last call, or if
+   no cable is open: the application should io_close and io_init
+   again.  */
+int io_changed(void);
+
 void io_close(void);
 
+/* Words per transfer when TDO is not read, 1 to XPC_MAX_CHUNK; 0 (the
+   default) uses the largest transfers between io_download (1) and
+   io_download (0), and 4 words otherwise.  */
+extern unsigned out_chunk;
+#define XPC_MAX_CHUNK 256
+
+/* Tell the library that the following scans that don't read TDO carry
+   a configuration download.  */
+void io_download(int on);
+
+/* Shift requests sent to the cable of io_init, and those of them that
+   read TDO back.  */
+extern unsigned long io_transfers, io_tdo_transfers;
+
+/* Defined in the library, set by the application.  */
 extern int verbose;
 extern int trace_usb;
-extern int trace_protocol;
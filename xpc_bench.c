@@ -0,0 +1,387 @@
+/*
+ * Microbenchmark for the XPCU bit packing kernels (xpc_pack.c).
+ *
+ * The cable is replaced by a fake transfer function which logs the A6
+ * stream and returns pseudo-random TDO words.  Every vector shape is first
+ * run through a copy of the original implementation and the OUT stream
+ * and the decoded TDO are checked byte for byte, so that faster kernels
+ * can be dropped in safely.  The cut-through kernel is checked the same
+ * way.
+ *
+ * Usage: make bench
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "xpc.h"
+#include "xpc_pack.h"
+
+/* Fake cable.  */
+
+struct fake_cable
+{
+    uint32_t seed;
+    int record;
+    uint8_t *log;
+    size_t log_len;
+    size_t log_size;
+    unsigned long transfers;
+};
+
+static uint32_t
+xorshift (uint32_t *s)
+{
+    uint32_t x = *s;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *s = x;
+}
+
+static void
+fake_shift (struct fake_cable *fc, int bits, const uint8_t *in,
+            int out_len, uint8_t *out)
+{
+    int in_len = 2 * ((bits + 3) >> 2);
+    int i;
+
+    fc->transfers++;
+    if (fc->record) {
+        if (fc->log_len + in_len + 2 > fc->log_size) {
+            fc->log_size = 2 * (fc->log_size + in_len + 2);
+            fc->log = realloc (fc->log, fc->log_size);
+            if (fc->log == NULL) {
+                perror ("realloc");
+                exit (1);
+            }
+        }
+        fc->log[fc->log_len++] = bits;
+        fc->log[fc->log_len++] = bits >> 8;
+        memcpy (fc->log + fc->log_len, in, in_len);
+        fc->log_len += in_len;
+    }
+
+    for (i = 0; i < out_len; i++)
+        out[i] = xorshift (&fc->seed);
+}
+
+static int
+fake_transfer (xpc_ext_transfer_state_t *xts, void *arg)
+{
+    int out_len = 2 * ((xts->out_bits + 15) >> 4);
+
+    fake_shift (arg, xts->in_bits, xts->buf, out_len, xts->buf);
+    xpcu_unpack_tdo (xts, xts->buf);
+
+    xts->in_bits = 0;
+    xts->out_bits = 0;
+
+    return 0;
+}
+
+/* Reference implementation: the kernels as they were in xpc.c.  */
+
+typedef struct
+{
+    struct fake_cable *xpcu;
+    int in_bits;
+    int out_bits;
+    int out_done;
+    uint8_t *out;
+    uint8_t buf[XPC_A6_CHUNKSIZE * 2];
+}
+ref_transfer_state_t;
+
+static int
+ref_do_ext_transfer (ref_transfer_state_t *xts)
+{
+    int out_len;
+
+    out_len = 2 * ((xts->out_bits + 15) >> 4);
+
+    fake_shift (xts->xpcu, xts->in_bits, xts->buf, out_len, xts->buf);
+
+    {
+        int out_idx = 0;
+        int out_rem = xts->out_bits;
+
+        while (out_rem > 0)
+        {
+            uint32_t mask, rxw;
+
+            rxw = (xts->buf[out_idx + 1] << 8) | xts->buf[out_idx];
+
+            mask = (out_rem >= 16) ? 1 : (1 << (16 - out_rem));
+
+            while (mask <= (1 << 15) && out_rem > 0)
+            {
+                unsigned last_tdo = (rxw & mask) ? 1 : 0;
+                if ((xts->out_done & 7) == 0)
+                    xts->out[xts->out_done >> 3] = last_tdo;
+                else
+                    xts->out[xts->out_done >> 3] |= last_tdo << (xts->out_done & 7);
+                xts->out_done++;
+                mask <<= 1;
+                out_rem--;
+            }
+
+            out_idx += 2;
+        }
+    }
+
+    xts->in_bits = 0;
+    xts->out_bits = 0;
+
+    return 0;
+}
+
+static void
+ref_add_bit_for_ext_transfer (ref_transfer_state_t *xts,
+                              unsigned tdi, unsigned tms,
+                              int is_real)
+{
+    int bit_idx = (xts->in_bits & 3);
+    int buf_idx = (xts->in_bits - bit_idx) >> 1;
+
+    if (bit_idx == 0) {
+        xts->buf[buf_idx] = 0;
+        xts->buf[buf_idx + 1] = 0;
+    }
+
+    xts->in_bits++;
+
+    if (is_real)
+    {
+        xts->buf[buf_idx] |= ((tms << 4) | tdi) << bit_idx;
+        xts->buf[buf_idx + 1] |= (0x11 << bit_idx);
+        xts->out_bits++;
+    }
+}
+
+static int
+ref_scan (const unsigned char *tdi, const unsigned char *tms,
+          unsigned char *tdo, unsigned len, struct fake_cable *fc)
+{
+    unsigned i;
+    ref_transfer_state_t xts;
+
+    xts.xpcu = fc;
+    xts.out = (uint8_t *) tdo;
+    xts.in_bits = 0;
+    xts.out_bits = 0;
+    xts.out_done = 0;
+
+    for (i = 0; i < len; i++) {
+        unsigned di = (tdi[i >> 3] >> (i & 7)) & 1;
+        unsigned tm = (tms[i >> 3] >> (i & 7)) & 1;
+        ref_add_bit_for_ext_transfer (&xts, di, tm, 1);
+        if (xts.in_bits == (4 * XPC_A6_CHUNKSIZE - 1))
+            ref_do_ext_transfer (&xts);
+    }
+
+    if (xts.in_bits > 0) {
+        if ((xts.in_bits & 3) == 0)
+            ref_add_bit_for_ext_transfer (&xts, 0, 0, 0);
+        ref_do_ext_transfer (&xts);
+    }
+
+    return 0;
+}
+
+/* Vector shapes.  */
+
+enum fill { FILL_RANDOM, FILL_ZERO, FILL_ONES };
+
+struct shape
+{
+    const char *name;
+    unsigned len;
+    enum fill tms;
+    enum fill tdi;
+};
+
+static const struct shape shapes[] =
+{
+    { "tms-nav",          6, FILL_RANDOM, FILL_ZERO },
+    { "ir-32",           32, FILL_ZERO,   FILL_RANDOM },
+    { "dr-32",           32, FILL_RANDOM, FILL_RANDOM },
+    { "dr-2k",      2048 * 8, FILL_RANDOM, FILL_RANDOM },
+    { "dr-2k-ctms", 2048 * 8, FILL_ZERO,   FILL_RANDOM },
+    { "dr-2k-ctdi", 2048 * 8, FILL_ZERO,   FILL_ONES },
+    { "dr-4M",      4 << 23, FILL_RANDOM, FILL_RANDOM },
+    { "dr-4M-ctms", 4 << 23, FILL_ZERO,   FILL_RANDOM },
+    { "dr-4M-ctdi", 4 << 23, FILL_ZERO,   FILL_ONES },
+};
+
+/* TDI slice for the cut-through check: one TCP segment.  */
+#define SLICE_BITS (1448 * 8)
+
+/* Roughly the number of bits clocked per measurement.  */
+#define BENCH_BITS (32u << 20)
+
+static void
+fill (uint8_t *v, unsigned len, enum fill how, uint32_t *seed)
+{
+    unsigned i;
+    unsigned nbytes = (len + 7) / 8;
+
+    for (i = 0; i < nbytes; i++)
+        switch (how) {
+        case FILL_RANDOM:
+            v[i] = xorshift (seed);
+            break;
+        case FILL_ZERO:
+            v[i] = 0;
+            break;
+        case FILL_ONES:
+            v[i] = 0xff;
+            break;
+        }
+}
+
+static double
+now (void)
+{
+    struct timespec t;
+
+    clock_gettime (CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static int
+run_shape (const struct shape *sh)
+{
+    unsigned nbytes = (sh->len + 7) / 8;
+    uint8_t *tms = malloc (nbytes);
+    uint8_t *tdi = malloc (nbytes);
+    uint8_t *tdo_ref = malloc (nbytes);
+    uint8_t *tdo = malloc (nbytes);
+    struct fake_cable ref_fc = { 1, 1, NULL, 0, 0 };
+    struct fake_cable fc = { 1, 1, NULL, 0, 0 };
+    struct fake_cable stream_fc = { 1, 1, NULL, 0, 0 };
+    xpc_stream_state_t st;
+    unsigned avail;
+    uint32_t seed = 0x12345678;
+    unsigned iter, i;
+    double t0, t_ref, t_new;
+    int ok;
+
+    if (!tms || !tdi || !tdo_ref || !tdo) {
+        perror ("malloc");
+        exit (1);
+    }
+
+    fill (tms, sh->len, sh->tms, &seed);
+    fill (tdi, sh->len, sh->tdi, &seed);
+    /* Leave the shift state on the last bit, like clients do.  */
+    if (sh->tms == FILL_ZERO)
+        tms[(sh->len - 1) >> 3] |= 1 << ((sh->len - 1) & 7);
+
+    /* Byte exact check against the reference.  */
+    ref_scan (tdi, tms, tdo_ref, sh->len, &ref_fc);
+    xpcu_scan_bits (tdi, tms, tdo, sh->len, fake_transfer, &fc);
+    ok = (ref_fc.log_len == fc.log_len
+          && memcmp (ref_fc.log, fc.log, fc.log_len) == 0
+          && memcmp (tdo_ref, tdo, nbytes) == 0);
+
+    /* The cut-through kernel, fed with TCP segment sized slices.  */
+    memset (tdo, 0, nbytes);
+    xpcu_stream_begin (&st, tms, tdo, sh->len, XPC_A6_OUT_CHUNKSIZE);
+    for (avail = 0; avail < sh->len; ) {
+        avail = avail + SLICE_BITS < sh->len ? avail + SLICE_BITS : sh->len;
+        xpcu_stream_feed (&st, tdi, avail, fake_transfer, &stream_fc);
+    }
+    ok = ok && (ref_fc.log_len == stream_fc.log_len
+                && memcmp (ref_fc.log, stream_fc.log, stream_fc.log_len) == 0
+                && memcmp (tdo_ref, tdo, nbytes) == 0);
+
+    iter = BENCH_BITS / sh->len;
+    if (iter == 0)
+        iter = 1;
+    ref_fc.record = 0;
+    fc.record = 0;
+
+    t0 = now ();
+    for (i = 0; i < iter; i++)
+        ref_scan (tdi, tms, tdo_ref, sh->len, &ref_fc);
+    t_ref = now () - t0;
+
+    t0 = now ();
+    for (i = 0; i < iter; i++)
+        xpcu_scan_bits (tdi, tms, tdo, sh->len, fake_transfer, &fc);
+    t_new = now () - t0;
+
+    printf ("%-12s %9u %10.2f %10.2f %7.2fx  %s\n",
+            sh->name, sh->len,
+            t_ref * 1e9 / ((double) iter * sh->len),
+            t_new * 1e9 / ((double) iter * sh->len),
+            t_ref / t_new, ok ? "ok" : "MISMATCH");
+
+    free (ref_fc.log);
+    free (fc.log);
+    free (stream_fc.log);
+    free (tms);
+    free (tdi);
+    free (tdo_ref);
+    free (tdo);
+
+    return ok;
+}
+
+/* A configuration download: TDO is not read, TMS stays low.  Each
+   transfer costs at least a USB round trip on the cable, so the number
+   of transfers is what the chunk size buys.  */
+static void
+run_download (unsigned chunk)
+{
+    unsigned len = 4 << 23;
+    unsigned nbytes = len / 8;
+    uint8_t *tms = calloc (nbytes, 1);
+    uint8_t *tdi = malloc (nbytes);
+    struct fake_cable fc = { 1, 0, NULL, 0, 0 };
+    uint32_t seed = 0x12345678;
+    double t0, t;
+
+    if (!tms || !tdi) {
+        perror ("malloc");
+        exit (1);
+    }
+    fill (tdi, len, FILL_RANDOM, &seed);
+    tms[nbytes - 1] = 0x80;
+
+    t0 = now ();
+    xpcu_scan_bits_out (tdi, tms, len, chunk, fake_transfer, &fc);
+    t = now () - t0;
+
+    printf ("%-12s %9u %10.2f %10lu %8.1f\n",
+            "download", len, t * 1e9 / len, fc.transfers,
+            (double) len / fc.transfers);
+
+    free (tms);
+    free (tdi);
+}
+
+int
+main (int argc, char **argv)
+{
+    unsigned i;
+    int ok = 1;
+
+    printf ("%-12s %9s %10s %10s %8s  %s\n",
+            "shape", "bits", "ref ns/bit", "ns/bit", "speedup", "check");
+
+    for (i = 0; i < sizeof (shapes) / sizeof (shapes[0]); i++)
+        ok &= run_shape (&shapes[i]);
+
+    printf ("\n%-12s %9s %10s %10s %8s  (chunk %d, then %d words)\n",
+            "shape", "bits", "ns/bit", "transfers", "bits/xfr",
+            XPC_A6_CHUNKSIZE, XPC_A6_OUT_CHUNKSIZE);
+    run_download (XPC_A6_CHUNKSIZE);
+    run_download (XPC_A6_OUT_CHUNKSIZE);
+
+    return ok ? 0 : 1;
+}
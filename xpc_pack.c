@@ -0,0 +1,379 @@
+/*
+ * Host side bit packing for the XPCU A6 shift request.
+ *
+ * Extracted from xpc.c, see there for the copyright and the description
+ * of the A6 transfer format.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "xpc.h"
+#include "xpc_pack.h"
+
+/* ---------------------------------------------------------------------- */
+
+/* Decode the TDO words RX received for the bits of XTS into XTS->out.  */
+
+void
+xpcu_unpack_tdo (xpc_ext_transfer_state_t *xts, const uint8_t *rx)
+{
+    int out_idx = 0;
+    int out_rem = xts->out_bits;
+
+    while (out_rem > 0)
+    {
+        uint32_t mask, rxw;
+
+        rxw = (rx[out_idx + 1] << 8) | rx[out_idx];
+
+        /* In the last (incomplete) word, the data isn't shifted completely to LSB */
+
+        mask = (out_rem >= 16) ? 1 : (1 << (16 - out_rem));
+
+        while (mask <= (1 << 15) && out_rem > 0)
+        {
+            unsigned last_tdo = (rxw & mask) ? 1 : 0;
+            if ((xts->out_done & 7) == 0)
+                xts->out[xts->out_done >> 3] = last_tdo;
+            else
+                xts->out[xts->out_done >> 3] |= last_tdo << (xts->out_done & 7);
+            xts->out_done++;
+            mask <<= 1;
+            out_rem--;
+        }
+
+        out_idx += 2;
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+
+void
+xpcu_add_bit_for_ext_transfer (xpc_ext_transfer_state_t *xts,
+                               unsigned tdi, unsigned tms,
+                               int is_real)
+{
+    int bit_idx = (xts->in_bits & 3);
+    int buf_idx = (xts->in_bits - bit_idx) >> 1;
+
+    if (bit_idx == 0) {
+        /* Clear for the next chunk. */
+        xts->buf[buf_idx] = 0;
+        xts->buf[buf_idx + 1] = 0;
+    }
+
+    xts->in_bits++;
+
+    if (is_real)
+    {
+        xts->buf[buf_idx] |= ((tms << 4) | tdi) << bit_idx;
+        xts->buf[buf_idx + 1] |= (0x11 << bit_idx);
+        xts->out_bits++;
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+
+/** Shift LEN bits of TDI/TMS, storing the TDO bits read into TDO.
+    TRANSFER is called for each chunk with ARG.
+    @return 0 on success; -1 on error */
+int
+xpcu_scan_bits (const unsigned char *tdi, const unsigned char *tms,
+                unsigned char *tdo, unsigned len,
+                xpc_transfer_fn transfer, void *arg)
+{
+    unsigned i;
+    int res;
+    xpc_ext_transfer_state_t xts;
+
+    /* Initialize state.  */
+    xts.out = (uint8_t *) tdo;
+    xts.in_bits = 0;
+    xts.out_bits = 0;
+    xts.out_done = 0;
+
+    for (i = 0; i < len; i++) {
+        unsigned di = (tdi[i >> 3] >> (i & 7)) & 1;
+        unsigned tm = (tms[i >> 3] >> (i & 7)) & 1;
+        xpcu_add_bit_for_ext_transfer (&xts, di, tm, 1);
+        if (xts.in_bits == (4 * XPC_A6_CHUNKSIZE - 1)) {
+            res = transfer (&xts, arg);
+            if (res < 0)
+                return -1;
+        }
+    }
+
+    if (xts.in_bits > 0) {
+        /* CPLD doesn't like multiples of 4; add one dummy bit */
+        if ((xts.in_bits & 3) == 0)
+            xpcu_add_bit_for_ext_transfer (&xts, 0, 0, 0);
+        res = transfer (&xts, arg);
+        if (res < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* ---------------------------------------------------------------------- */
+
+/** Same as xpcu_scan_bits, but TDO is not read back.  The bits are only
+    clocked (bits 12..15 of the A6 words are left clear), so there is no
+    bulk IN transfer and chunks of CHUNK words (at most
+    XPC_A6_OUT_CHUNKSIZE) can be sent at once.
+    @return 0 on success; -1 on error */
+int
+xpcu_scan_bits_out (const unsigned char *tdi, const unsigned char *tms,
+                    unsigned len, unsigned chunk,
+                    xpc_transfer_fn transfer, void *arg)
+{
+    unsigned i;
+    int res;
+    int chunk_bits;
+    xpc_ext_transfer_state_t xts;
+
+    if (chunk < 1 || chunk > XPC_A6_OUT_CHUNKSIZE)
+        chunk = XPC_A6_OUT_CHUNKSIZE;
+    chunk_bits = 4 * chunk - 1;
+
+    xts.out = NULL;
+    xts.in_bits = 0;
+    xts.out_bits = 0;
+    xts.out_done = 0;
+
+    for (i = 0; i < len; i++) {
+        unsigned di = (tdi[i >> 3] >> (i & 7)) & 1;
+        unsigned tm = (tms[i >> 3] >> (i & 7)) & 1;
+        int bit_idx = (xts.in_bits & 3);
+        int buf_idx = (xts.in_bits - bit_idx) >> 1;
+
+        if (bit_idx == 0) {
+            xts.buf[buf_idx] = 0;
+            xts.buf[buf_idx + 1] = 0;
+        }
+        xts.buf[buf_idx] |= ((tm << 4) | di) << bit_idx;
+        xts.buf[buf_idx + 1] |= 0x01 << bit_idx;
+        xts.in_bits++;
+
+        if (xts.in_bits == chunk_bits) {
+            res = transfer (&xts, arg);
+            if (res < 0)
+                return -1;
+        }
+    }
+
+    if (xts.in_bits > 0) {
+        /* CPLD doesn't like multiples of 4; add one dummy bit */
+        if ((xts.in_bits & 3) == 0)
+            xpcu_add_bit_for_ext_transfer (&xts, 0, 0, 0);
+        res = transfer (&xts, arg);
+        if (res < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* ---------------------------------------------------------------------- */
+
+struct xpc_batch
+{
+    struct xpc_scan *scans;
+    int added;          /* scans whose bits are all in the stream */
+    int done;           /* scans completed */
+    unsigned tdo_pos;   /* offset of the TDO of scan DONE in TDO */
+    uint8_t *tdo;       /* TDO of the scans that need it, back to back */
+    xpc_scan_done_fn done_fn;
+    void *done_arg;
+};
+
+/* Send the pending bits, then copy the TDO of the scans now complete to
+   their descriptors and report them.  */
+
+static int
+xpcu_batch_flush (struct xpc_batch *b, xpc_ext_transfer_state_t *xts,
+                  xpc_transfer_fn transfer, void *arg)
+{
+    if (xts->in_bits > 0) {
+        /* CPLD doesn't like multiples of 4; add one dummy bit */
+        if ((xts->in_bits & 3) == 0)
+            xpcu_add_bit_for_ext_transfer (xts, 0, 0, 0);
+        if (transfer (xts, arg) < 0)
+            return -1;
+    }
+
+    for (; b->done < b->added; b->done++) {
+        struct xpc_scan *s = &b->scans[b->done];
+        unsigned i;
+
+        if (s->tdo != NULL) {
+            memset (s->tdo, 0, (s->len + 7) / 8);
+            for (i = 0; i < s->len; i++) {
+                unsigned j = b->tdo_pos + i;
+                if ((b->tdo[j >> 3] >> (j & 7)) & 1)
+                    s->tdo[i >> 3] |= 1 << (i & 7);
+            }
+            b->tdo_pos += s->len;
+        }
+        if (b->done_fn)
+            b->done_fn (s, b->done_arg);
+    }
+    return 0;
+}
+
+/** Shift the COUNT scans of SCANS as one stream.  Chunks holding TDO
+    bits are limited to XPC_A6_CHUNKSIZE words, the others go up to CHUNK
+    words, so runs of scans without TDO use the large transfers.  DONE,
+    if not NULL, is called with DONE_ARG for each scan once its bits are
+    sent and its TDO is stored.
+    @return 0 on success; -1 on error */
+int
+xpcu_scan_batch (struct xpc_scan *scans, int count, unsigned chunk,
+                 xpc_transfer_fn transfer, void *arg,
+                 xpc_scan_done_fn done, void *done_arg)
+{
+    struct xpc_batch b;
+    xpc_ext_transfer_state_t xts;
+    unsigned tdo_bits = 0;
+    int chunk_bits;
+    int k, r = -1;
+
+    if (chunk < 1 || chunk > XPC_A6_OUT_CHUNKSIZE)
+        chunk = XPC_A6_OUT_CHUNKSIZE;
+    chunk_bits = 4 * chunk - 1;
+
+    for (k = 0; k < count; k++)
+        if (scans[k].tdo != NULL)
+            tdo_bits += scans[k].len;
+
+    b.scans = scans;
+    b.added = 0;
+    b.done = 0;
+    b.tdo_pos = 0;
+    b.tdo = malloc (tdo_bits / 8 + 1);
+    b.done_fn = done;
+    b.done_arg = done_arg;
+    if (b.tdo == NULL)
+        return -1;
+
+    xts.out = b.tdo;
+    xts.in_bits = 0;
+    xts.out_bits = 0;
+    xts.out_done = 0;
+
+    for (k = 0; k < count; k++) {
+        const unsigned char *tdi = scans[k].tdi;
+        const unsigned char *tms = scans[k].tms;
+        int rd = scans[k].tdo != NULL;
+        unsigned i;
+
+        for (i = 0; i < scans[k].len; i++) {
+            unsigned di = (tdi[i >> 3] >> (i & 7)) & 1;
+            unsigned tm = (tms[i >> 3] >> (i & 7)) & 1;
+            int bit_idx, buf_idx;
+
+            if (xts.in_bits == chunk_bits
+                || (xts.in_bits >= 4 * XPC_A6_CHUNKSIZE - 1
+                    && (rd || xts.out_bits > 0))) {
+                if (xpcu_batch_flush (&b, &xts, transfer, arg) < 0)
+                    goto out;
+            }
+
+            bit_idx = (xts.in_bits & 3);
+            buf_idx = (xts.in_bits - bit_idx) >> 1;
+            if (bit_idx == 0) {
+                xts.buf[buf_idx] = 0;
+                xts.buf[buf_idx + 1] = 0;
+            }
+            xts.buf[buf_idx] |= ((tm << 4) | di) << bit_idx;
+            xts.buf[buf_idx + 1] |= (rd ? 0x11 : 0x01) << bit_idx;
+            xts.in_bits++;
+            xts.out_bits += rd;
+        }
+        b.added = k + 1;
+    }
+
+    r = xpcu_batch_flush (&b, &xts, transfer, arg);
+
+out:
+    free (b.tdo);
+    return r;
+}
+
+/* ---------------------------------------------------------------------- */
+
+void
+xpcu_stream_begin (xpc_stream_state_t *st, const unsigned char *tms,
+                   unsigned char *tdo, unsigned len, unsigned chunk)
+{
+    if (chunk < 1 || chunk > XPC_A6_OUT_CHUNKSIZE)
+        chunk = XPC_A6_OUT_CHUNKSIZE;
+
+    st->tms = tms;
+    st->len = len;
+    st->pos = 0;
+    st->read_tdo = tdo != NULL;
+    st->chunk_bits = st->read_tdo ? 4 * XPC_A6_CHUNKSIZE - 1 : 4 * chunk - 1;
+
+    st->xts.out = tdo;
+    st->xts.in_bits = 0;
+    st->xts.out_bits = 0;
+    st->xts.out_done = 0;
+}
+
+/** Shift the bits of the stream up to AVAIL, TDI holding at least the
+    first AVAIL bits of the vector.  Bits that don't fill a chunk are kept
+    for the next call, unless AVAIL is the length of the vector.  The
+    chunks and the TDO are the same as with xpcu_scan_bits, or
+    xpcu_scan_bits_out if no TDO is read.
+    @return the number of bits stored in TDO so far; -1 on error */
+int
+xpcu_stream_feed (xpc_stream_state_t *st, const unsigned char *tdi,
+                  unsigned avail, xpc_transfer_fn transfer, void *arg)
+{
+    xpc_ext_transfer_state_t *xts = &st->xts;
+    const unsigned char *tms = st->tms;
+    unsigned tck = st->read_tdo ? 0x11 : 0x01;
+    unsigned i;
+
+    if (avail > st->len)
+        avail = st->len;
+
+    for (i = st->pos; i < avail; i++) {
+        unsigned di = (tdi[i >> 3] >> (i & 7)) & 1;
+        unsigned tm = (tms[i >> 3] >> (i & 7)) & 1;
+        int bit_idx = (xts->in_bits & 3);
+        int buf_idx = (xts->in_bits - bit_idx) >> 1;
+
+        if (bit_idx == 0) {
+            xts->buf[buf_idx] = 0;
+            xts->buf[buf_idx + 1] = 0;
+        }
+        xts->buf[buf_idx] |= ((tm << 4) | di) << bit_idx;
+        xts->buf[buf_idx + 1] |= tck << bit_idx;
+        xts->in_bits++;
+        xts->out_bits += st->read_tdo;
+
+        if (xts->in_bits == st->chunk_bits) {
+            if (transfer (xts, arg) < 0)
+                return -1;
+        }
+    }
+    st->pos = avail;
+
+    if (st->pos == st->len && xts->in_bits > 0) {
+        /* CPLD doesn't like multiples of 4; add one dummy bit */
+        if ((xts->in_bits & 3) == 0)
+            xpcu_add_bit_for_ext_transfer (xts, 0, 0, 0);
+        if (transfer (xts, arg) < 0)
+            return -1;
+    }
+
+    return xts->out_done;
+}
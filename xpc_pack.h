@@ -0,0 +1,67 @@
+/*
+ * Host side bit packing for the XPCU A6 shift request.
+ *
+ * These kernels don't depend on libusb so that they can be exercised and
+ * benchmarked on their own (see xpc_bench.c).
+ */
+
+#include <stdint.h>
+
+/* 16-bit words. More than 4 currently leads to bit errors; 13 to serious problems */
+#define XPC_A6_CHUNKSIZE 4
+
+/* Upper bound for the chunk size when no TDO is read back: one 512-byte
+   high-speed bulk packet.  */
+#define XPC_A6_OUT_CHUNKSIZE 256
+
+typedef struct
+{
+    int in_bits;
+    int out_bits;
+    int out_done;
+    uint8_t *out;
+    uint8_t buf[XPC_A6_OUT_CHUNKSIZE * 2];
+}
+xpc_ext_transfer_state_t;
+
+/* Send the bits accumulated in XTS->buf to the cable, read back the
+   2 * ceil(XTS->out_bits / 16) bytes of TDO into XTS->buf and call
+   xpcu_unpack_tdo.  Must reset in_bits and out_bits.
+   @return 0 on success; -1 on error */
+typedef int (*xpc_transfer_fn) (xpc_ext_transfer_state_t *xts, void *arg);
+
+void xpcu_add_bit_for_ext_transfer (xpc_ext_transfer_state_t *xts,
+                                    unsigned tdi, unsigned tms, int is_real);
+
+void xpcu_unpack_tdo (xpc_ext_transfer_state_t *xts, const uint8_t *rx);
+
+int xpcu_scan_bits (const unsigned char *tdi, const unsigned char *tms,
+                    unsigned char *tdo, unsigned len,
+                    xpc_transfer_fn transfer, void *arg);
+
+int xpcu_scan_bits_out (const unsigned char *tdi, const unsigned char *tms,
+                        unsigned len, unsigned chunk,
+                        xpc_transfer_fn transfer, void *arg);
+
+/* Batches of scans, see io_scan_batch in xpc.h.  */
+int xpcu_scan_batch (struct xpc_scan *scans, int count, unsigned chunk,
+                     xpc_transfer_fn transfer, void *arg,
+                     xpc_scan_done_fn done, void *done_arg);
+
+/* Cut-through scans, see io_scan_begin in xpc.h.  */
+typedef struct
+{
+    xpc_ext_transfer_state_t xts;
+    const unsigned char *tms;
+    unsigned len;
+    unsigned pos;
+    int read_tdo;
+    int chunk_bits;
+}
+xpc_stream_state_t;
+
+void xpcu_stream_begin (xpc_stream_state_t *st, const unsigned char *tms,
+                        unsigned char *tdo, unsigned len, unsigned chunk);
+
+int xpcu_stream_feed (xpc_stream_state_t *st, const unsigned char *tdi,
+                      unsigned avail, xpc_transfer_fn transfer, void *arg);
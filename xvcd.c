@@ -2,93 +2,1545 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include <time.h>
+#include <poll.h>
+#include <signal.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 
 #include "xpc.h"
+#include "jtag.h"
+#include "svf.h"
+#include "zbits.h"
+#include "chain.h"
+#include "vtap.h"
+#include "profile.h"
+#include "probes.h"
 
-int verbose;
-int trace_usb;
 int trace_protocol;
 
 //
-// JTAG state machine.
+// Workload profile, by connection.  Shifts outside a connection (chain
+// discovery) go to prof_server.
 //
+static struct profile prof_server, prof_closed;
+static struct profile *conn_prof[FD_SETSIZE];
+static struct profile *prof = &prof_server;
 
-enum jtag_state_t
+// USB transfer counts when they were last added to prof.
+static unsigned long prof_transfers, prof_tdo_transfers;
+
+// Print the profile of each connection when it closes (-A).
+static int profile_close;
+static volatile sig_atomic_t profile_request;
+
+//
+// Configuration download.
+//
+// While a bitstream is shifted into the configuration logic (IR holds
+// CFG_IN), clients ignore TDO.  Long shift-dr scans are then sent to the
+// cable without reading TDO back, using the largest transfers, and zeros
+// are returned to the client.
+//
+
+int cfg_fast = 1;
+
+// Minimum number of bits in shift-dr for a scan to take the fast path.
+#define CFG_DOWNLOAD_MIN_BITS 64
+
+// Xilinx CFG_IN instruction, by IR length.
+static const struct
+{
+	unsigned len;
+	unsigned value;
+} cfg_in_insns[] =
+{
+	{ 6, 0x05 },	// Virtex-II, Spartan-3, Spartan-6, Virtex-6, 7 series
+	{ 10, 0x3c5 },	// Virtex-4, Virtex-5
+};
+
+// Last value shifted into the IR of the whole chain, LSB first.
+static unsigned char ir_bits[64];
+static unsigned ir_len;
+static int ir_loaded;		// ir_bits went to the IR since the last reset,
+				// -1 if it was changed behind trace_scan
+static int cfg_download;
+
+static int ir_bit(unsigned i)
+{
+	return (ir_bits[i / 8] >> (i & 7)) & 1;
+}
+
+//
+// Return 1 if the IR holds CFG_IN for one device, the other devices
+// being in BYPASS (all ones).
+//
+static int is_cfg_in(void)
+{
+	unsigned k, off, i;
+
+	if (ir_len > 8 * sizeof(ir_bits))
+		return 0;
+
+	for (k = 0; k < sizeof(cfg_in_insns) / sizeof(cfg_in_insns[0]); k++)
+		for (off = 0; off + cfg_in_insns[k].len <= ir_len; off++)
+		{
+			for (i = 0; i < ir_len; i++)
+			{
+				int expect = 1;
+				if (i >= off && i < off + cfg_in_insns[k].len)
+					expect = (cfg_in_insns[k].value >> (i - off)) & 1;
+				if (ir_bit(i) != expect)
+					break;
+			}
+			if (i == ir_len)
+				return 1;
+		}
+	return 0;
+}
+
+static int sread(int fd, void *target, int len)
+{
+   unsigned char *t = target;
+   while (len) {
+      int r = read(fd, t, len);
+      if (r <= 0)
+         return r;
+      t += r;
+      len -= r;
+   }
+   return 1;
+}
+
+//
+// Input of a compressed shift.  The socket is peeked in blocks and the
+// bytes are only consumed once decoded, so that the next command stays
+// in the socket for select.  During a cut-through shift, the decoded
+// TDI is fed to the cable every ZIN_FEED bytes, and before the block is
+// refilled.
+//
+#define ZIN_BLOCK 16384
+#define ZIN_FEED 4096
+
+struct zin
+{
+  int fd;
+  unsigned char buf[ZIN_BLOCK];
+  int pos, len;
+  const unsigned char *tdi;	// cut-through: the TDI being decoded
+  int bits, fed, decoded;
+  int lost;			// io_scan_feed failed
+};
+
+static struct zin zin;
+
+static void zin_begin(struct zin *z, int fd)
+{
+  z->fd = fd;
+  z->pos = z->len = 0;
+  z->tdi = NULL;
+  z->lost = 0;
+}
+
+// Consume the decoded bytes of the current block.
+static int zin_end(struct zin *z)
+{
+  int r = z->pos ? sread(z->fd, z->buf, z->pos) : 1;
+
+  z->pos = z->len = 0;
+  return r == 1 ? 0 : -1;
+}
+
+static int zread(void *arg, void *target, int len)
+{
+  struct zin *z = arg;
+  unsigned char *t = target;
+
+  while (len)
+    {
+      int n;
+
+      if (z->pos == z->len)
+        {
+          if (z->lost || zin_end(z) < 0)
+            return 0;
+          n = recv(z->fd, z->buf, sizeof(z->buf), MSG_PEEK);
+          if (n <= 0)
+            return n;
+          z->len = n;
+        }
+      n = z->len - z->pos < len ? z->len - z->pos : len;
+      memcpy(t, z->buf + z->pos, n);
+      z->pos += n;
+      t += n;
+      len -= n;
+    }
+  return 1;
+}
+
+static void zfeed(void *arg, int done)
+{
+  struct zin *z = arg;
+  int bits = done * 8 < z->bits ? done * 8 : z->bits;
+
+  z->decoded = done;
+  if (z->tdi && !z->lost && bits > z->fed
+      && (z->pos == z->len || bits - z->fed >= ZIN_FEED * 8))
+    {
+      if (io_scan_feed(z->tdi, bits) < 0)
+        z->lost = 1;
+      z->fed = bits;
+    }
+}
+
+//
+// Protocol extensions, enabled with -x and listed in the getinfo reply
+// after the vector size: "xvcServer_v1.0:2048:svf,xsvf\n".
+//
+int extensions;
+
+static const char * const xvc_extensions[] =
+{
+	"svf",		// svf:<len><SVF text>, replies <len><report>
+	"xsvf",		// xsvf:<len><XSVF data>, replies <len><report>
+	"poll",		// poll:<program>, see handle_poll
+	"zshift",	// zshift:<bits><tms><tdi>, compressed shift (zbits.h)
+	"chain",	// chain:<flags>, cached topology, see handle_chain
+	"ila",		// ila:<request>, ILA capture, see handle_ila
+	NULL
+};
+
+// Largest vector, in bytes, offered to clients (-b).
+static unsigned vector_size = 2048;
+
+static char xvcInfo[128];
+
+// TMS and TDI, TDO and compressed TDO of shift commands.
+static unsigned char *shift_buffer, *shift_result, *shift_zresult;
+
+static void make_info(void)
+{
+  char *p = xvcInfo + sprintf(xvcInfo, "xvcServer_v1.0:%u", vector_size);
+  int i;
+
+  for (i = 0; extensions && xvc_extensions[i]; i++)
+    p += sprintf(p, "%c%s", i ? ',' : ':', xvc_extensions[i]);
+  strcpy(p, "\n");
+}
+
+static void cable_lost(void);
+
+// Maximum size of an uploaded SVF/XSVF file.
+#define SVF_MAX_UPLOAD (256 << 20)
+
+//
+// Run an uploaded SVF (or XSVF) file and reply with its report.
+//
+static int handle_svf(int fd, int xsvf, int *state)
+{
+  unsigned len, rlen;
+  char *data;
+  struct svf_report rep;
+  char report[256];
+  int r;
+
+  if (sread(fd, &len, 4) != 1)
+    return 1;
+  if (len > SVF_MAX_UPLOAD)
+    {
+      fprintf(stderr, "svf file too large\n");
+      return 1;
+    }
+
+  data = malloc(len + 1);
+  if (data == NULL)
+    {
+      perror("malloc");
+      return 1;
+    }
+  if (sread(fd, data, len) != 1)
+    {
+      free(data);
+      return 1;
+    }
+
+  if (xsvf)
+    r = xsvf_play((unsigned char *)data, len, state, &rep);
+  else
+    r = svf_play(data, len, state, &rep);
+  free(data);
+
+  svf_report_str(&rep, report, sizeof(report));
+  if (verbose || r < 0)
+    printf("%s %s", xsvf ? "xsvf" : "svf", report);
+  if (rep.lost)
+    cable_lost();
+
+  rlen = strlen(report);
+  if (write(fd, &rlen, 4) != 4 || write(fd, report, rlen) != rlen)
+    {
+      perror("write");
+      return 1;
+    }
+  return rep.lost;
+}
+
+static enum jtag_state_t jtag_state = test_logic_reset;
+
+//
+// The TAP was driven without trace_scan (SVF player, chain discovery,
+// per-TAP ports) and left in STATE.  The IR is that of the reset if
+// RESET_IR, unknown otherwise.
+//
+static void tap_untracked(enum jtag_state_t state, int reset_ir)
+{
+  jtag_state = state;
+  ir_len = 0;
+  ir_loaded = reset_ir ? 0 : -1;
+  cfg_download = 0;
+}
+
+//
+// Follow the TAP state through a scan, recording the value shifted into
+// the IR.  Return the number of bits shifted in shift_dr during a
+// configuration download, or 0 if some were shifted outside of one.
+//
+static int trace_scan(const unsigned char *tms_bits,
+                      const unsigned char *tdi_bits, int len)
+{
+  int i;
+  int dr_bits = 0;
+  int other_dr = 0;
+
+  for (i = 0; i < len; ++i)
+    {
+      enum jtag_state_t pstate = jtag_state;
+      int tms = !!(tms_bits[i/8] & (1<<(i&7)));
+
+      if (pstate == shift_ir)
+        {
+          int tdi = !!(tdi_bits[i/8] & (1<<(i&7)));
+          if (ir_len < 8 * sizeof(ir_bits))
+            {
+              if (tdi)
+                ir_bits[ir_len / 8] |= 1 << (ir_len & 7);
+              else
+                ir_bits[ir_len / 8] &= ~(1 << (ir_len & 7));
+            }
+          ir_len++;
+        }
+      else if (pstate == shift_dr && cfg_download)
+        dr_bits++;
+      else if (pstate == shift_dr)
+        other_dr = 1;
+
+      prof->state_bits[pstate]++;
+      jtag_state = jtag_step(jtag_state, tms);
+
+      if (jtag_state == capture_ir)
+        ir_len = 0;
+      else if (jtag_state == update_ir && jtag_state != pstate)
+        {
+          profile_ir(prof, ir_bits, ir_len);
+          ir_loaded = 1;
+          cfg_download = cfg_fast && is_cfg_in();
+          if (verbose && cfg_download)
+            printf("configuration download\n");
+        }
+      else if (jtag_state == test_logic_reset)
+        {
+          ir_loaded = 0;
+          cfg_download = 0;
+        }
+
+      if (trace_protocol > 1 && jtag_state != pstate)
+        printf("jtag state %s\n", state_name[jtag_state]);
+    }
+
+  return other_dr ? 0 : dr_bits;
+}
+
+//
+// Cut-through shifts.
+//
+// A large shift starts on the cable as soon as its TMS vector is in:
+// TDI is fed to the cable as it arrives from the network and TDO goes
+// back as it is decoded, so that the two transfers overlap.  The TDI of
+// shift_ir is needed up front to detect the configuration download, so
+// scans through shift_ir are read whole as usual.
+//
+#define CUT_THROUGH_MIN_BITS 8192
+
+static int can_cut_through(const unsigned char *tms, int len)
+{
+  int state = jtag_state;
+  int i;
+
+  if (len < CUT_THROUGH_MIN_BITS || trace_protocol)
+    return 0;
+  for (i = 0; i < len; i++)
+    {
+      if (state == shift_ir)
+        return 0;
+      state = jtag_next(state, (tms[i / 8] >> (i & 7)) & 1);
+    }
+  return 1;
+}
+
+//
+// Shift LEN bits whose TMS is in TMS, reading TDI from FD into TDI and
+// writing TDO from TDO (zeros if !READ_TDO) as it becomes final.
+// Clients usually send the whole shift before reading its TDO, so TDO
+// is only written when the socket can take it, without blocking; the
+// rest goes once all of TDI has arrived.
+// If the client goes away, the scan is completed with zeros so that the
+// TAP ends in the tracked state.  Return 1 on a socket or cable error.
+//
+static int shift_cut_through(int fd, const unsigned char *tms,
+                             unsigned char *tdi, unsigned char *tdo,
+                             int read_tdo, int len)
+{
+  int nr_bytes = (len + 7) / 8;
+  int got = 0, sent = 0, ready = 0, done;
+  int r = 0;
+
+  io_scan_begin(tms, read_tdo ? tdo : NULL, len);
+  while (got < nr_bytes)
+    {
+      struct pollfd p = { fd, POLLIN, 0 };
+      int n;
+
+      if (!r && sent < ready)
+        p.events |= POLLOUT;
+      if (!r && poll(&p, 1, -1) < 0 && errno != EINTR)
+        {
+          perror("poll");
+          r = 1;
+        }
+      if (!r && (p.revents & POLLOUT))
+        {
+          n = send(fd, tdo + sent, ready - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+          if (n > 0)
+            sent += n;
+          else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+              perror("send");
+              r = 1;
+            }
+        }
+      if (!r && !(p.revents & (POLLIN | POLLHUP | POLLERR)))
+        continue;
+
+      n = r ? 0 : read(fd, tdi + got, nr_bytes - got);
+      if (n <= 0)
+        {
+          memset(tdi + got, 0, nr_bytes - got);
+          n = nr_bytes - got;
+          r = 1;
+        }
+      got += n;
+
+      done = io_scan_feed(tdi, got * 8 < len ? got * 8 : len);
+      if (done < 0)
+        {
+          cable_lost();
+          return 1;
+        }
+      if (read_tdo)
+        ready = done / 8;
+    }
+
+  if (!r && write(fd, tdo + sent, nr_bytes - sent) != nr_bytes - sent)
+    {
+      perror("write");
+      r = 1;
+    }
+  return r;
+}
+
+//
+// shift_cut_through for zshift: TDI is fed to the cable as it is
+// decoded from Z, and TDO is compressed into ZTDO and written once the
+// scan is done.
+//
+static int zshift_cut_through(struct zin *z, const unsigned char *tms,
+                              unsigned char *tdi, unsigned char *tdo,
+                              unsigned char *ztdo, int read_tdo, int len)
+{
+  int nr_bytes = (len + 7) / 8;
+  int zlen, r = 0;
+
+  io_scan_begin(tms, read_tdo ? tdo : NULL, len);
+  z->tdi = tdi;
+  z->bits = len;
+  z->fed = z->decoded = 0;
+  if (zbits_decode_progress(zread, z, tdi, nr_bytes, zfeed) < 0
+      || zin_end(z) < 0)
+    {
+      if (!z->lost)
+        fprintf(stderr, "decoding compressed data failed\n");
+      memset(tdi + z->decoded, 0, nr_bytes - z->decoded);
+      r = 1;
+    }
+  z->tdi = NULL;
+  if (z->lost || (z->fed < len && io_scan_feed(tdi, len) < 0))
+    {
+      cable_lost();
+      return 1;
+    }
+  if (r)
+    return 1;
+
+  zlen = zbits_encode(tdo, nr_bytes, ztdo, 1);
+  if (write(z->fd, ztdo, zlen) != zlen)
+    {
+      perror("write");
+      return 1;
+    }
+  return 0;
+}
+
+//
+// Polling macros.
+//
+// A program is a list of vectors, concatenated into one scan, that is
+// repeated until the TDO of one of them matches VALUE under MASK.
+//
+
+// Maximum number of bits of a polling program.
+#define POLL_MAX_BITS (64 * 1024 * 8)
+
+struct poll_prog
+{
+  unsigned char *tms, *tdi, *tdo;
+  int len;
+  int check_off, check_len;	// the vector whose TDO is checked
+  unsigned char *mask, *value;
+  unsigned max_iter;
+  unsigned delay_us;
+};
+
+static void copy_bits(unsigned char *dst, int dst_off,
+                      const unsigned char *src, int len)
+{
+  int i;
+
+  for (i = 0; i < len; i++)
+    {
+      int d = dst_off + i;
+      if (src[i / 8] & (1 << (i & 7)))
+        dst[d / 8] |= 1 << (d & 7);
+      else
+        dst[d / 8] &= ~(1 << (d & 7));
+    }
+}
+
+//
+// Run PP.  Return 1 if the value matched, 0 if not after MAX_ITER
+// iterations, -1 on error.  *ITER is the number of iterations done.
+//
+static int poll_run(struct poll_prog *pp, unsigned *iter)
+{
+  int i;
+
+  for (*iter = 1; ; ++*iter)
+    {
+      int match = 1;
+
+      trace_scan(pp->tms, pp->tdi, pp->len);
+      if (io_scan(pp->tdi, pp->tms, pp->tdo, pp->len) < 0)
+        return -1;
+
+      for (i = 0; i < pp->check_len && match; i++)
+        {
+          int b = pp->check_off + i;
+          int m = (pp->mask[i / 8] >> (i & 7)) & 1;
+          int v = (pp->value[i / 8] >> (i & 7)) & 1;
+          if (m && ((pp->tdo[b / 8] >> (b & 7)) & 1) != v)
+            match = 0;
+        }
+
+      if (match)
+        return 1;
+      if (*iter >= pp->max_iter)
+        return 0;
+      if (pp->delay_us)
+        usleep(pp->delay_us);
+    }
+}
+
+//
+// poll:<max iterations><delay us><vector count><checked vector>
+//      { <bits><tms bytes><tdi bytes> } ...
+//      <mask bytes><value bytes>
+//
+// The program should leave the TAP in the state it started from.  Mask
+// and value have the size of the checked vector (numbered from 0).  The
+// reply is <iterations><matched><TDO bytes of the checked vector>.
+//
+static int handle_poll(int fd)
+{
+  struct poll_prog pp;
+  unsigned hdr[4];
+  unsigned char vec[2 * 2048];
+  unsigned v, iter;
+  int nbytes = 0;
+  int r = 1;
+  int res;
+
+  memset(&pp, 0, sizeof(pp));
+  if (sread(fd, hdr, sizeof(hdr)) != 1)
+    return 1;
+  pp.max_iter = hdr[0];
+  pp.delay_us = hdr[1];
+
+  pp.tms = malloc(POLL_MAX_BITS / 8);
+  pp.tdi = malloc(POLL_MAX_BITS / 8);
+  pp.tdo = malloc(POLL_MAX_BITS / 8);
+  if (!pp.tms || !pp.tdi || !pp.tdo)
+    {
+      perror("malloc");
+      goto out;
+    }
+
+  for (v = 0; v < hdr[2]; v++)
+    {
+      int len;
+
+      if (sread(fd, &len, 4) != 1)
+        goto out;
+      nbytes = (len + 7) / 8;
+      if (len <= 0 || nbytes * 2 > sizeof(vec) || pp.len + len > POLL_MAX_BITS)
+        {
+          fprintf(stderr, "poll: bad vector length %d\n", len);
+          goto out;
+        }
+      if (sread(fd, vec, 2 * nbytes) != 1)
+        goto out;
+      copy_bits(pp.tms, pp.len, vec, len);
+      copy_bits(pp.tdi, pp.len, vec + nbytes, len);
+      if (v == hdr[3])
+        {
+          pp.check_off = pp.len;
+          pp.check_len = len;
+        }
+      pp.len += len;
+    }
+  if (pp.check_len == 0)
+    {
+      fprintf(stderr, "poll: bad checked vector\n");
+      goto out;
+    }
+
+  nbytes = (pp.check_len + 7) / 8;
+  if (sread(fd, vec, 2 * nbytes) != 1)
+    goto out;
+  pp.mask = vec;
+  pp.value = vec + nbytes;
+
+  res = poll_run(&pp, &iter);
+  if (res < 0)
+    {
+      cable_lost();
+      goto out;
+    }
+  if (trace_protocol || verbose)
+    printf("poll: %s after %u iterations\n",
+           res ? "matched" : "no match", iter);
+
+  hdr[0] = iter;
+  hdr[1] = res;
+  memset(vec, 0, nbytes);
+  for (v = 0; v < pp.check_len; v++)
+    {
+      int b = pp.check_off + v;
+      if (pp.tdo[b / 8] & (1 << (b & 7)))
+        vec[v / 8] |= 1 << (v & 7);
+    }
+  if (write(fd, hdr, 8) != 8 || write(fd, vec, nbytes) != nbytes)
+    {
+      perror("write");
+      goto out;
+    }
+  r = 0;
+
+out:
+  free(pp.tms);
+  free(pp.tdi);
+  free(pp.tdo);
+  return r;
+}
+
+//
+// Retry of lost scans.
+//
+// When a cable transfer is lost after the cable clocked its bits (see
+// io_usb_stats), the TAP state is unknown.  The server keeps the TAP
+// state and the IR at the last shift that started outside a DR or IR
+// scan, the checkpoint, and a log of the scans done since.  To retry, it
+// resets the TAP, loads the IR again, goes back to the checkpoint state,
+// replays the log and shifts the lost scans again.
+//
+// Shifting a DR again can have side effects (a configuration frame
+// written twice, a FIFO read twice), so the log and the lost scans may
+// only shift a DR with the IR of the checkpoint, and only if that IR
+// is the one of the reset (IDCODE or BYPASS) or all ones (BYPASS).  IR
+// scans are shifted again as they are: loading the same instruction
+// twice does nothing more.  This is never done during a configuration
+// download, nor when the IR was changed behind trace_scan.  Otherwise
+// the scan fails: the cable is closed and the session with it
+// (cable_lost).
+//
+#define SCAN_RETRIES 2
+#define REPLAY_MAX_BITS (64 * 1024)
+
+static struct
+{
+  enum jtag_state_t state;
+  unsigned char ir[sizeof(ir_bits)];
+  unsigned ir_len;		// 0 if the IR is that of the reset
+  int ir_known;			// ... 0 if it is not known at all
+  int dr_safe;			// DR scans with this IR have no side effects
+  unsigned long transfers;	// io_transfers at the end of the log
+  unsigned char tms[REPLAY_MAX_BITS / 8], tdi[REPLAY_MAX_BITS / 8];
+  int len;			// -1 if the log overflowed
+  enum jtag_state_t end;	// state at the end of the log
+  int ir_changed;		// the log went through update_ir
+  int unsafe;			// the log shifted a DR with side effects
+} checkpoint;
+
+static unsigned scans_recovered, scans_lost;
+
+static int settled(int state)
+{
+  return state == test_logic_reset || state == run_test_idle
+    || state == select_dr_scan || state == select_ir_scan;
+}
+
+static void set_checkpoint(void)
+{
+  unsigned i;
+
+  checkpoint.state = jtag_state;
+  checkpoint.ir_len = ir_loaded > 0 ? ir_len : 0;
+  checkpoint.ir_known = ir_loaded >= 0;
+  checkpoint.dr_safe = ir_loaded == 0;
+  if (checkpoint.ir_len <= 8 * sizeof(ir_bits))
+    {
+      memcpy(checkpoint.ir, ir_bits, (checkpoint.ir_len + 7) / 8);
+      for (i = 0; i < checkpoint.ir_len && ir_bit(i); i++)
+        ;
+      if (checkpoint.ir_len && i == checkpoint.ir_len)
+        checkpoint.dr_safe = 1;
+    }
+  checkpoint.transfers = io_transfers;
+  checkpoint.len = 0;
+  checkpoint.end = jtag_state;
+  checkpoint.ir_changed = 0;
+  checkpoint.unsafe = 0;
+}
+
+// Follow *STATE through the LEN clocks of TMS, setting *IR_CHANGED when
+// the IR is updated.  Return 1 if some of them shift a DR that may have
+// side effects: any DR once the IR has changed, and all of them if the
+// IR of the checkpoint is not known to be harmless.
+static int clocks_unsafe(enum jtag_state_t *state, int *ir_changed,
+                         const unsigned char *tms, int len)
+{
+  int unsafe = 0;
+  int i;
+
+  for (i = 0; i < len; i++)
+    {
+      if (*state == shift_dr && (*ir_changed || !checkpoint.dr_safe))
+        unsafe = 1;
+      *state = jtag_next(*state, (tms[i / 8] >> (i & 7)) & 1);
+      if (*state == update_ir)
+        *ir_changed = 1;
+    }
+  return unsafe;
+}
+
+static void put_bit(unsigned char *b, int i, int v)
+{
+  if (v)
+    b[i / 8] |= 1 << (i & 7);
+  else
+    b[i / 8] &= ~(1 << (i & 7));
+}
+
+static void log_scans(const struct xpc_scan *scans, int count)
+{
+  int i;
+
+  for (i = 0; i < count && checkpoint.len >= 0; i++)
+    if (checkpoint.len + scans[i].len > REPLAY_MAX_BITS)
+      checkpoint.len = -1;
+    else
+      {
+        copy_bits(checkpoint.tms, checkpoint.len, scans[i].tms, scans[i].len);
+        copy_bits(checkpoint.tdi, checkpoint.len, scans[i].tdi, scans[i].len);
+        checkpoint.len += scans[i].len;
+        checkpoint.unsafe |= clocks_unsafe(&checkpoint.end,
+                                           &checkpoint.ir_changed,
+                                           scans[i].tms, scans[i].len);
+      }
+  checkpoint.transfers = io_transfers;
+}
+
+// Return 1 if the TAP can be taken back to where scans starting now
+// would start.
+static int can_replay(void)
+{
+  // Scans not in the log were done since the checkpoint.
+  return io_transfers == checkpoint.transfers && settled(checkpoint.state)
+    && checkpoint.len >= 0 && checkpoint.ir_known
+    && checkpoint.ir_len <= 8 * sizeof(ir_bits);
+}
+
+// Return 1 if the COUNT SCANS, starting at the end of the log, can be
+// shifted again after the log is replayed without side effects.
+static int safe_replay(const struct xpc_scan *scans, int count)
+{
+  enum jtag_state_t state = checkpoint.end;
+  int ir_changed = checkpoint.ir_changed;
+  int i;
+
+  if (cfg_download || checkpoint.unsafe)
+    return 0;
+  for (i = 0; i < count; i++)
+    if (clocks_unsafe(&state, &ir_changed, scans[i].tms, scans[i].len))
+      return 0;
+  return 1;
+}
+
+// Take the TAP back to the checkpoint and replay the log.
+static int recover(void)
+{
+  unsigned char tms[(5 + 5 + 8 * sizeof(ir_bits) + 2 + 8) / 8];
+  unsigned char tdi[sizeof(tms)];
+  int from = test_logic_reset;
+  int len = 0, i, n;
+  unsigned path;
+
+  memset(tdi, 0, sizeof(tdi));
+  for (i = 0; i < 5; i++)
+    put_bit(tms, len++, 1);
+  if (checkpoint.ir_len)
+    {
+      // run_test_idle, select_dr_scan, select_ir_scan, capture, shift
+      for (i = 0; i < 5; i++)
+        put_bit(tms, len++, i == 1 || i == 2);
+      for (i = 0; i < checkpoint.ir_len; i++)
+        {
+          put_bit(tdi, len, (checkpoint.ir[i / 8] >> (i & 7)) & 1);
+          put_bit(tms, len++, i == checkpoint.ir_len - 1);
+        }
+      put_bit(tms, len++, 1);		// update
+      put_bit(tms, len++, 0);		// run_test_idle
+      from = run_test_idle;
+    }
+  n = jtag_path(from, checkpoint.state, &path);
+  for (i = 0; i < n; i++)
+    put_bit(tms, len++, (path >> i) & 1);
+
+  {
+    struct xpc_scan scans[2] =
+    {
+      { tms, tdi, NULL, len },
+      { checkpoint.tms, checkpoint.tdi, NULL, checkpoint.len },
+    };
+    return io_scan_batch(scans, checkpoint.len ? 2 : 1);
+  }
+}
+
+// io_scan_batch, retried from the checkpoint if it fails and the retry
+// is safe.
+static int scan_batch(struct xpc_scan *scans, int count)
+{
+  int replay = can_replay();
+  int i;
+
+  if (io_scan_batch(scans, count) == 0)
+    {
+      if (replay)
+        log_scans(scans, count);
+      return 0;
+    }
+  if (replay && !safe_replay(scans, count))
+    {
+      fprintf(stderr, "scan lost in a DR scan with side effects, not retried\n");
+      replay = 0;
+    }
+  for (i = 0; replay && i < SCAN_RETRIES; i++)
+    {
+      fprintf(stderr, "scan lost, retrying it from %s\n",
+              state_name[checkpoint.state]);
+      if (recover() == 0 && io_scan_batch(scans, count) == 0)
+        {
+          scans_recovered++;
+          log_scans(scans, count);
+          return 0;
+        }
+    }
+  scans_lost++;
+  return -1;
+}
+
+//
+// Write-behind (-w).
+//
+// A shift that clocks no bit in shift_ir or shift_dr (TMS navigation,
+// run_test_idle clocks) returns meaningless TDO.  With -w it is answered
+// at once with zeros and queued.  The queue goes to the cable in the
+// same batch as the next shift that reads TDO, before anything else
+// uses the cable, and whenever the client has nothing more in flight.
+//
+int write_behind;
+
+#define WB_MAX_BITS (64 * 1024)
+
+static unsigned char wb_tms[WB_MAX_BITS / 8], wb_tdi[WB_MAX_BITS / 8];
+static int wb_len;
+
+// Return 1 if the shift goes through neither shift_ir nor shift_dr:
+// its TDO means nothing.
+static int dont_care(const unsigned char *tms, int len)
+{
+  int state = jtag_state;
+  int i;
+
+  for (i = 0; i < len; i++)
+    {
+      if (state == shift_ir || state == shift_dr)
+        return 0;
+      state = jtag_next(state, (tms[i / 8] >> (i & 7)) & 1);
+    }
+  return 1;
+}
+
+//
+// A scan failed for good: the TAP state is lost.  Drop the queued shifts
+// and close the cable, so that the sessions that used it fail (see
+// check_cable) and the next one opens it again.
+//
+static void cable_lost(void)
+{
+  fprintf(stderr, "io_scan failed, closing the cable\n");
+  wb_len = 0;
+  io_close();
+}
+
+// The write-behind functions return -1 after cable_lost.
+static int wb_flush(void)
+{
+  struct xpc_scan scan = { wb_tms, wb_tdi, NULL, wb_len };
+
+  if (wb_len == 0)
+    return 0;
+  if (scan_batch(&scan, 1) < 0)
+    {
+      cable_lost();
+      return -1;
+    }
+  wb_len = 0;
+  return 0;
+}
+
+static int wb_add(const unsigned char *tms, const unsigned char *tdi,
+                  int len)
+{
+  if (wb_len + len > WB_MAX_BITS && wb_flush() < 0)
+    return -1;
+  copy_bits(wb_tms, wb_len, tms, len);
+  copy_bits(wb_tdi, wb_len, tdi, len);
+  wb_len += len;
+  return 0;
+}
+
+// io_scan, after the queued shifts.
+static int wb_scan(const unsigned char *tdi, const unsigned char *tms,
+                   unsigned char *tdo, int len)
+{
+  struct xpc_scan scans[2] =
+  {
+    { wb_tms, wb_tdi, NULL, wb_len },
+    { tms, tdi, tdo, len },
+  };
+  int r;
+
+  if (wb_len == 0)
+    r = scan_batch(scans + 1, 1);
+  else
+    r = scan_batch(scans, 2);
+  wb_len = 0;
+  if (r < 0)
+    cable_lost();
+  return r;
+}
+
+// Return 1 if the client has sent more data.
+static int pending_input(int fd)
+{
+  struct pollfd p = { fd, POLLIN, 0 };
+
+  return poll(&p, 1, 0) > 0;
+}
+
+//
+// Chain topology.
+//
+// The chain is discovered once at startup and again when a cable is
+// plugged, and kept for the chain: extension and the stats port, so that
+// tools can skip their own discovery.  chain: with the revalidate flag
+// reads the IDCODEs again (one scan) and rediscovers if they changed.
+//
+static struct chain chain;
+static int chain_valid;
+static int irlens[CHAIN_MAX_DEVICES];
+static int nirlens;
+
+// chain:<flags>, replies <status><count>{<idcode><irlen>}*
+#define CHAIN_REVALIDATE 1
+
+#define CHAIN_CACHED 0		// not checked
+#define CHAIN_VALIDATED 1	// IDCODEs read again, unchanged
+#define CHAIN_DISCOVERED 2	// chain changed, discovered again
+#define CHAIN_UNKNOWN 3		// discovery failed
+
+// Cable, to open it again after hotplug.
+static unsigned cable_vendor, cable_product;
+static const char *cable_desc, *cable_firmware;
+
+// Opening of the cable each connection has used, 0 for none yet.
+static unsigned cable_generation = 1;
+static unsigned conn_generation[FD_SETSIZE];
+
+// Cables the stream is broadcast to (-B), the first one included.
+static int cable_count = 1;
+
+static int open_cables(void)
+{
+  if (io_init(cable_vendor, cable_product, cable_desc, cable_firmware))
+    {
+      fprintf(stderr, "io_init failed\n");
+      return -1;
+    }
+  if (cable_count > 1
+      && io_broadcast_init(cable_vendor, cable_product, cable_firmware,
+                           cable_count))
+    {
+      fprintf(stderr, "io_broadcast_init failed\n");
+      io_close();
+      return -1;
+    }
+  return 0;
+}
+
+static void print_cables(FILE *f)
+{
+  struct io_cable_stats st;
+  int i;
+
+  if (cable_count < 2)
+    return;
+  for (i = 0; io_cable_stats(i, &st) == 0; i++)
+    fprintf(f, "cable %d: %u scans, %u mismatches, %u errors%s\n", i,
+            st.scans, st.mismatches, st.errors, st.failed ? ", dropped" : "");
+}
+
+static struct
+{
+  time_t start;
+  unsigned sessions;
+  unsigned shifts;
+  unsigned long long bits;
+  unsigned discoveries;
+} stats;
+
+static void discover_chain(void)
+{
+  chain_valid = chain_discover(&chain, nirlens ? irlens : NULL,
+                               nirlens) == 0;
+  if (!chain_valid)
+    chain.ndev = 0;
+  stats.discoveries++;
+
+  tap_untracked(run_test_idle, 0);
+  vtap_invalidate();
+}
+
+//
+// Open the cable again if it was unplugged, and rediscover the chain.
+// A connection that has already used the cable lost its TAP state with
+// it: close the cable and fail it instead, and let the next connection
+// open the cable.  Return 0 if a cable is open for the connection FD.
+//
+static int check_cable(int fd)
+{
+  if (io_changed())
+    {
+      wb_len = 0;
+      io_close();
+      cable_generation++;
+      if (conn_generation[fd])
+        {
+          printf("cable changed, closing the session\n");
+          return -1;
+        }
+      printf("cable changed, opening it again\n");
+      if (open_cables() < 0)
+        return -1;
+      discover_chain();
+      chain_print(stdout, &chain);
+    }
+  if (conn_generation[fd] == 0)
+    conn_generation[fd] = cable_generation;
+  return conn_generation[fd] == cable_generation ? 0 : -1;
+}
+
+static int handle_chain(int fd, int flags)
+{
+  uint32_t reply[2 + 2 * CHAIN_MAX_DEVICES];
+  uint32_t status = chain_valid ? CHAIN_CACHED : CHAIN_UNKNOWN;
+  int i, n;
+
+  if (flags & CHAIN_REVALIDATE)
+    {
+      int r = chain_valid ? chain_validate(&chain) : 0;
+
+      if (r < 0)
+        {
+          cable_lost();
+          return 1;
+        }
+      // chain_validate reset the TAP and read the IDCODEs.
+      tap_untracked(run_test_idle, 1);
+      vtap_invalidate();
+      if (r)
+        status = CHAIN_VALIDATED;
+      else
+        {
+          discover_chain();
+          status = chain_valid ? CHAIN_DISCOVERED : CHAIN_UNKNOWN;
+        }
+    }
+
+  reply[0] = status;
+  reply[1] = chain.ndev;
+  for (i = 0; i < chain.ndev; i++)
+    {
+      reply[2 + 2 * i] = chain.dev[i].idcode;
+      reply[3 + 2 * i] = chain.dev[i].irlen;
+    }
+  n = 4 * (2 + 2 * chain.ndev);
+  if (write(fd, reply, n) != n)
+    {
+      perror("write");
+      return 1;
+    }
+  return 0;
+}
+
+//
+// ILA capture.
+//
+// A ChipScope ILA core sits behind a BSCAN USER register.  The analyzer
+// polls its status until the trigger fires, then reads the capture
+// through many small DR scans: here both happen in the server.  The
+// USER instruction and the BYPASS padding of the other devices come
+// from the cached chain.
+//
+
+// Xilinx USER1-4 instructions, by family (IDCODE bits 27-21) and IR
+// length; 0 where the family has no such instruction.
+#define XILINX_MANUFACTURER 0x093
+#define XILINX_FAMILY(idcode) (((idcode) >> 21) & 0x7f)
+
+static const struct
+{
+  unsigned family;
+  int irlen;
+  unsigned user[4];
+} user_insns[] =
+{
+  { 0x08, 6, { 0x02, 0x03, 0, 0 } },			// Virtex-II
+  { 0x0a, 6, { 0x02, 0x03, 0, 0 } },			// Spartan-3
+  { 0x0e, 6, { 0x02, 0x03, 0, 0 } },			// Spartan-3E
+  { 0x11, 6, { 0x02, 0x03, 0, 0 } },			// Spartan-3A
+  { 0x0b, 10, { 0x3c2, 0x3c3, 0, 0 } },			// Virtex-4 LX
+  { 0x0f, 10, { 0x3c2, 0x3c3, 0, 0 } },			// Virtex-4 FX
+  { 0x10, 10, { 0x3c2, 0x3c3, 0, 0 } },			// Virtex-4 SX
+  { 0x14, 10, { 0x3c2, 0x3c3, 0x3e2, 0x3e3 } },		// Virtex-5
+  { 0x15, 10, { 0x3c2, 0x3c3, 0x3e2, 0x3e3 } },
+  { 0x17, 10, { 0x3c2, 0x3c3, 0x3e2, 0x3e3 } },
+  { 0x19, 10, { 0x3c2, 0x3c3, 0x3e2, 0x3e3 } },
+  { 0x20, 6, { 0x02, 0x03, 0x1a, 0x1b } },		// Spartan-6
+  { 0x21, 10, { 0x3c2, 0x3c3, 0x3e2, 0x3e3 } },		// Virtex-6
+  { 0x1b, 6, { 0x02, 0x03, 0x22, 0x23 } },		// 7 series
+};
+
+// Return the USER instruction of device DEV of the chain, or 0 if it is
+// not known.
+static unsigned user_insn(int dev, int user)
+{
+  uint32_t idcode;
+  int i;
+
+  if (!chain_valid || dev < 0 || dev >= chain.ndev || user < 1 || user > 4)
+    return 0;
+  idcode = chain.dev[dev].idcode;
+  if ((idcode & 0xfff) != XILINX_MANUFACTURER)
+    return 0;
+  for (i = 0; i < sizeof(user_insns) / sizeof(user_insns[0]); i++)
+    if (user_insns[i].family == XILINX_FAMILY(idcode)
+        && user_insns[i].irlen == chain.dev[dev].irlen)
+      return user_insns[i].user[user - 1];
+  return 0;
+}
+
+// Largest status or read word, and capture, in bits.
+#define ILA_MAX_WORD (2048 * 8)
+#define ILA_MAX_CAPTURE (512u << 20)
+
+// Reads per batch.
+#define ILA_BATCH 1024
+
+#define ILA_CAPTURED 1		// triggered, capture follows
+#define ILA_NO_TRIGGER 0	// max iterations reached
+#define ILA_BAD 2		// no such device or USER instruction
+
+// Append to TMS/TDI at *LEN a scan of DEV's register, from run_test_idle
+// back to it: BITS bits of TDI, padded with ones for the other devices
+// (their IR, or their BYPASS register).  Return the offset of DEV's bits.
+static int add_user_scan(unsigned char *tms, unsigned char *tdi, int *len,
+                         int ir, int dev, const unsigned char *bits,
+                         int nbits)
+{
+  int pre = 0, post = 0;
+  int i, n, off;
+
+  for (i = 0; i < chain.ndev; i++)
+    {
+      int w = ir ? chain.dev[i].irlen : 1;
+      if (i < dev)
+        pre += w;
+      else if (i > dev)
+        post += w;
+    }
+
+  // select_dr_scan, (select_ir_scan,) capture, shift
+  for (i = 0; i < (ir ? 4 : 3); i++)
+    {
+      put_bit(tms, *len, i < (ir ? 2 : 1));
+      put_bit(tdi, (*len)++, 0);
+    }
+  off = *len;
+  n = pre + nbits + post;
+  for (i = 0; i < n; i++)
+    {
+      int d = i < pre || i >= pre + nbits
+              || ((bits[(i - pre) / 8] >> ((i - pre) & 7)) & 1);
+      put_bit(tms, *len, i == n - 1);
+      put_bit(tdi, (*len)++, d);
+    }
+  // update, run_test_idle
+  put_bit(tms, *len, 1);
+  put_bit(tdi, (*len)++, 0);
+  put_bit(tms, *len, 0);
+  put_bit(tdi, (*len)++, 0);
+  return off + pre;
+}
+
+// Extract NBITS bits at OFF of SRC into DST at DST_OFF.
+static void get_bits(unsigned char *dst, int dst_off,
+                     const unsigned char *src, int off, int nbits)
+{
+  int i;
+
+  for (i = 0; i < nbits; i++)
+    put_bit(dst, dst_off + i, (src[(off + i) / 8] >> ((off + i) & 7)) & 1);
+}
+
+//
+// Read COUNT words of NBITS from DEV's USER register, shifting TDI in
+// each, into CAPTURE.  The reads are sent ILA_BATCH at a time as one
+// stream of transfers.
+//
+static int ila_read(int dev, const unsigned char *tdi, int nbits,
+                    unsigned count, unsigned char *capture)
+{
+  unsigned char tms_pat[(ILA_MAX_WORD + CHAIN_MAX_DEVICES + 8) / 8];
+  unsigned char tdi_pat[sizeof(tms_pat)];
+  struct xpc_scan *scans = malloc(ILA_BATCH * sizeof(*scans));
+  unsigned char *tdo = NULL;
+  int len = 0, nbytes, off;
+  unsigned done = 0, k;
+  int r = -1;
+
+  off = add_user_scan(tms_pat, tdi_pat, &len, 0, dev, tdi, nbits);
+  nbytes = (len + 7) / 8;
+  tdo = malloc(ILA_BATCH * nbytes);
+  if (scans == NULL || tdo == NULL)
+    {
+      perror("malloc");
+      goto out;
+    }
+
+  while (done < count)
+    {
+      unsigned n = count - done < ILA_BATCH ? count - done : ILA_BATCH;
+
+      for (k = 0; k < n; k++)
+        {
+          scans[k].tms = tms_pat;
+          scans[k].tdi = tdi_pat;
+          scans[k].tdo = tdo + k * nbytes;
+          scans[k].len = len;
+          trace_scan(tms_pat, tdi_pat, len);
+        }
+      if (io_scan_batch(scans, n) < 0)
+        goto out;
+      for (k = 0; k < n; k++)
+        get_bits(capture, (done + k) * nbits, tdo + k * nbytes, off, nbits);
+      done += n;
+    }
+  r = 0;
+
+out:
+  free(scans);
+  free(tdo);
+  return r;
+}
+
+//
+// ila:<device><user><max iterations><delay us><status bits><read bits>
+//     <reads><status tdi><mask><value><read tdi>
+//
+// Load USER<user> (1-4) into the IR of <device>, then scan its status
+// word, shifting <status tdi>, every <delay us> until the TDO matches
+// <value> under <mask>.  On a match, read <reads> words of <read bits>,
+// shifting <read tdi> in each.  The reply is <result><iterations>
+// <status tdo>, then the words read, back to back, if <result> is 1.
+// The TAP ends in run_test_idle.
+//
+static int handle_ila(int fd)
 {
-	test_logic_reset, run_test_idle,
+  struct poll_prog pp;
+  unsigned hdr[7];
+  unsigned char *status_tdi = NULL, *mask = NULL, *value = NULL;
+  unsigned char *read_tdi = NULL, *status = NULL, *capture = NULL;
+  unsigned iter = 0;
+  unsigned long long capture_bits;
+  int sbytes, rbytes, cbytes = 0;
+  int dev, user, ir = 0;
+  unsigned reply[2];
+  int r = 1;
+  int res = ILA_BAD;
+  unsigned path;
+  int i;
 
-	select_dr_scan, capture_dr, shift_dr,
-	exit1_dr, pause_dr, exit2_dr, update_dr,
+  memset(&pp, 0, sizeof(pp));
+  if (sread(fd, hdr, sizeof(hdr)) != 1)
+    return 1;
+  dev = hdr[0];
+  user = hdr[1];
+  capture_bits = (unsigned long long)hdr[5] * hdr[6];
+  if (hdr[4] < 1 || hdr[4] > ILA_MAX_WORD || hdr[5] < 1
+      || hdr[5] > ILA_MAX_WORD || capture_bits > ILA_MAX_CAPTURE)
+    {
+      fprintf(stderr, "ila: bad sizes\n");
+      return 1;
+    }
+  sbytes = (hdr[4] + 7) / 8;
+  rbytes = (hdr[5] + 7) / 8;
 
-	select_ir_scan, capture_ir, shift_ir,
-	exit1_ir, pause_ir, exit2_ir, update_ir,
+  status_tdi = malloc(sbytes);
+  mask = malloc(sbytes);
+  value = malloc(sbytes);
+  status = calloc(1, sbytes);
+  read_tdi = malloc(rbytes);
+  pp.tms = calloc(1, POLL_MAX_BITS / 8);
+  pp.tdi = calloc(1, POLL_MAX_BITS / 8);
+  pp.tdo = malloc(POLL_MAX_BITS / 8);
+  if (!status_tdi || !mask || !value || !status || !read_tdi
+      || !pp.tms || !pp.tdi || !pp.tdo)
+    {
+      perror("malloc");
+      goto out;
+    }
+  if (sread(fd, status_tdi, sbytes) != 1 || sread(fd, mask, sbytes) != 1
+      || sread(fd, value, sbytes) != 1 || sread(fd, read_tdi, rbytes) != 1)
+    goto out;
 
-	num_states
-};
+  ir = user_insn(dev, user);
+  if (ir)
+    res = ILA_NO_TRIGGER;
+  else
+    {
+      fprintf(stderr, "ila: no USER%d in device %d\n", user, dev);
+      goto reply;
+    }
 
-static const char * const state_name[] =
+  // Go to run_test_idle and load the USER instruction.
+  if (wb_flush() < 0)
+    goto out;
+  i = jtag_path(jtag_state, run_test_idle, &path);
+  for (pp.len = 0; pp.len < i; pp.len++)
+    put_bit(pp.tms, pp.len, (path >> pp.len) & 1);
   {
-   [test_logic_reset] = "RESET",
-   [run_test_idle]    = "IDLE",
-   [select_dr_scan]   = "DRSELECT",
-   [capture_dr]       = "DRCAPTURE",
-   [shift_dr]         = "DRSHIFT",
-   [exit1_dr]         = "DREXIT1",
-   [pause_dr]         = "DRPAUSE",
-   [exit2_dr]         = "DREXIT2",
-   [update_dr]        = "DRUPDATE",
-   [select_ir_scan]   = "IRSELECT",
-   [capture_ir]       = "IRCAPTURE",
-   [shift_ir]         = "IRSHIFT",
-   [exit1_ir]         = "IREXIT1",
-   [pause_ir]         = "IRPAUSE",
-   [exit2_ir]         = "IREXIT2",
-   [update_ir]        = "IRUPDATE",
-};
+    unsigned char bits[4] = { ir, ir >> 8, ir >> 16, ir >> 24 };
+    add_user_scan(pp.tms, pp.tdi, &pp.len, 1, dev, bits,
+                  chain.dev[dev].irlen);
+  }
+  trace_scan(pp.tms, pp.tdi, pp.len);
+  if (io_scan(pp.tdi, pp.tms, NULL, pp.len) < 0)
+    {
+      cable_lost();
+      goto out;
+    }
+
+  // Wait for the trigger.
+  pp.len = 0;
+  pp.check_off = add_user_scan(pp.tms, pp.tdi, &pp.len, 0, dev,
+                               status_tdi, hdr[4]);
+  pp.check_len = hdr[4];
+  pp.mask = mask;
+  pp.value = value;
+  pp.max_iter = hdr[2] ? hdr[2] : 1;
+  pp.delay_us = hdr[3];
+  res = poll_run(&pp, &iter);
+  if (res < 0)
+    {
+      cable_lost();
+      goto out;
+    }
+  get_bits(status, 0, pp.tdo, pp.check_off, hdr[4]);
+  if (trace_protocol || verbose)
+    printf("ila: %s after %u iterations\n",
+           res ? "triggered" : "no trigger", iter);
+
+  if (res == ILA_CAPTURED)
+    {
+      cbytes = (capture_bits + 7) / 8;
+      capture = calloc(1, cbytes ? cbytes : 1);
+      if (capture == NULL)
+        {
+          perror("malloc");
+          goto out;
+        }
+      if (ila_read(dev, read_tdi, hdr[5], hdr[6], capture) < 0)
+        {
+          cable_lost();
+          goto out;
+        }
+    }
+
+reply:
+  reply[0] = res;
+  reply[1] = iter;
+  if (write(fd, reply, 8) != 8 || write(fd, status, sbytes) != sbytes
+      || (cbytes && write(fd, capture, cbytes) != cbytes))
+    {
+      perror("write");
+      goto out;
+    }
+  r = 0;
+
+out:
+  free(status_tdi);
+  free(mask);
+  free(value);
+  free(status);
+  free(read_tdi);
+  free(capture);
+  free(pp.tms);
+  free(pp.tdi);
+  free(pp.tdo);
+  return r;
+}
 
-static int jtag_step(int state, int tms)
+// Add the USB transfers made since the last call to prof.
+static void count_transfers(void)
 {
-	static const int next_state[num_states][2] =
-	{
-		[test_logic_reset] = {run_test_idle, test_logic_reset},
-		[run_test_idle] = {run_test_idle, select_dr_scan},
+  prof->transfers += io_transfers - prof_transfers;
+  prof->tdo_transfers += io_tdo_transfers - prof_tdo_transfers;
+  prof_transfers = io_transfers;
+  prof_tdo_transfers = io_tdo_transfers;
+}
 
-		[select_dr_scan] = {capture_dr, select_ir_scan},
-		[capture_dr] = {shift_dr, exit1_dr},
-		[shift_dr] = {shift_dr, exit1_dr},
-		[exit1_dr] = {pause_dr, update_dr},
-		[pause_dr] = {pause_dr, exit2_dr},
-		[exit2_dr] = {shift_dr, update_dr},
-		[update_dr] = {run_test_idle, select_dr_scan},
+// Print the profile of each open connection, and the sum of all the
+// connections so far.
+static void print_profiles(FILE *f)
+{
+  struct profile all = prof_closed;
+  int fd;
 
-		[select_ir_scan] = {capture_ir, test_logic_reset},
-		[capture_ir] = {shift_ir, exit1_ir},
-		[shift_ir] = {shift_ir, exit1_ir},
-		[exit1_ir] = {pause_ir, update_ir},
-		[pause_ir] = {pause_ir, exit2_ir},
-		[exit2_ir] = {shift_ir, update_ir},
-		[update_ir] = {run_test_idle, select_dr_scan}
-	};
+  count_transfers();
+  for (fd = 0; fd < FD_SETSIZE; fd++)
+    if (conn_prof[fd])
+      {
+        fprintf(f, "connection %d:\n", fd);
+        profile_print(f, conn_prof[fd]);
+        profile_add(&all, conn_prof[fd]);
+      }
+  fprintf(f, "all connections:\n");
+  profile_print(f, &all);
+  fflush(f);
+}
 
-	return next_state[state][tms];
+static void request_profile(int sig)
+{
+  profile_request = 1;
 }
 
-static int sread(int fd, void *target, int len)
+// Called when the connection on FD closes.
+static void end_profile(int fd)
 {
-   unsigned char *t = target;
-   while (len) {
-      int r = read(fd, t, len);
-      if (r <= 0)
-         return r;
-      t += r;
-      len -= r;
-   }
-   return 1;
+  if (conn_prof[fd] == NULL)
+    return;
+  if (profile_close)
+    {
+      printf("connection %d closed:\n", fd);
+      profile_print(stdout, conn_prof[fd]);
+      fflush(stdout);
+    }
+  profile_add(&prof_closed, conn_prof[fd]);
+  free(conn_prof[fd]);
+  conn_prof[fd] = NULL;
+}
+
+// Text report for the stats port (-S).
+static void write_stats(int fd)
+{
+  FILE *f = fdopen(fd, "w");
+  struct io_usb_stats usb;
+
+  if (f == NULL)
+    {
+      close(fd);
+      return;
+    }
+  fprintf(f, "uptime %ld\n", (long)(time(NULL) - stats.start));
+  fprintf(f, "sessions %u\n", stats.sessions);
+  fprintf(f, "shifts %u\n", stats.shifts);
+  fprintf(f, "bits %llu\n", stats.bits);
+  fprintf(f, "discoveries %u\n", stats.discoveries);
+  io_usb_stats(&usb);
+  fprintf(f, "usb timeouts %lu, errors %lu, retries %lu, lost %lu\n",
+          usb.timeouts, usb.errors, usb.retries, usb.lost);
+  fprintf(f, "usb timeout %u ms, %u ms reading TDO\n",
+          usb.timeout_ms[0], usb.timeout_ms[1]);
+  fprintf(f, "scans recovered %u, lost %u\n", scans_recovered, scans_lost);
+  fprintf(f, "chain %s, %d devices\n", chain_valid ? "valid" : "unknown",
+          chain.ndev);
+  chain_print(f, &chain);
+  print_cables(f);
+  print_profiles(f);
+  fclose(f);
 }
 
 //
@@ -103,18 +1555,27 @@ int handle_data(int fd)
 {
   int i;
   int seen_tlr = 0;
-  static enum jtag_state_t jtag_state = test_logic_reset;
-  static const char xvcInfo[] = "xvcServer_v1.0:2048\n";
 
+  vtap_invalidate();
   do
     {
       char cmd[16];
-      unsigned char buffer[2*2048], result[2*1024];
+      unsigned char *buffer = shift_buffer, *result = shift_result;
+      unsigned char *zresult = shift_zresult;
       enum jtag_state_t istate;
+      int compressed = 0;
       memset(cmd, 0, 16);
 
+      if (profile_request)
+        {
+          profile_request = 0;
+          print_profiles(stdout);
+        }
+      if (wb_len && !pending_input(fd) && wb_flush() < 0)
+        return 1;
       if (sread(fd, cmd, 2) != 1)
         return 1;
+      PROBE1(command, cmd);
 
       if (memcmp(cmd, "ge", 2) == 0) {
         if (sread(fd, cmd, 6) != 1)
@@ -145,6 +1606,53 @@ int handle_data(int fd)
       } else if (memcmp(cmd, "sh", 2) == 0) {
         if (sread(fd, cmd, 4) != 1)
           return 1;
+      } else if (extensions && memcmp(cmd, "zs", 2) == 0) {
+        if (sread(fd, cmd, 5) != 1)
+          return 1;
+        compressed = 1;
+      } else if (extensions && (memcmp(cmd, "sv", 2) == 0
+                                || memcmp(cmd, "xs", 2) == 0)) {
+        int xsvf = cmd[0] == 'x';
+        int state = jtag_state;
+        if (sread(fd, cmd, xsvf ? 3 : 2) != 1)
+          return 1;
+        if (wb_flush() < 0)
+          return 1;
+        if (trace_protocol > 2)
+          printf("%u : Received command: '%s'\n", (int)time(NULL),
+                 xsvf ? "xsvf" : "svf");
+        if (handle_svf(fd, xsvf, &state))
+          return 1;
+        tap_untracked(state, state == test_logic_reset);
+        break;
+      } else if (extensions && memcmp(cmd, "ch", 2) == 0) {
+        if (sread(fd, cmd, 5) != 1)
+          return 1;
+        if (trace_protocol > 2)
+          printf("%u : Received command: 'chain'\n", (int)time(NULL));
+        if (wb_flush() < 0)
+          return 1;
+        if (handle_chain(fd, cmd[4]))
+          return 1;
+        break;
+      } else if (extensions && memcmp(cmd, "il", 2) == 0) {
+        if (sread(fd, cmd, 2) != 1)
+          return 1;
+        if (trace_protocol > 2)
+          printf("%u : Received command: 'ila'\n", (int)time(NULL));
+        if (handle_ila(fd))
+          return 1;
+        break;
+      } else if (extensions && memcmp(cmd, "po", 2) == 0) {
+        if (sread(fd, cmd, 3) != 1)
+          return 1;
+        if (wb_flush() < 0)
+          return 1;
+        if (trace_protocol > 2)
+          printf("%u : Received command: 'poll'\n", (int)time(NULL));
+        if (handle_poll(fd))
+          return 1;
+        break;
       } else {
 
         fprintf(stderr, "invalid cmd '%s'-ignoring\n", cmd);
@@ -152,6 +1660,16 @@ int handle_data(int fd)
       }
 
       istate = jtag_state;
+      if (wb_len == 0 && settled(jtag_state))
+        set_checkpoint();
+
+      //
+      // Only allow exiting if the state is rti and the IR
+      // has the default value (IDCODE) by going through test_logic_reset.
+      // As soon as going through capture_dr or capture_ir no exit is
+      // allowed as this will change DR/IR.
+      //
+      seen_tlr = (seen_tlr || jtag_state == test_logic_reset) && (jtag_state != capture_dr) && (jtag_state != capture_ir);
 
       int len;
       if (sread(fd, &len, 4) != 1)
@@ -161,17 +1679,77 @@ int handle_data(int fd)
         }
 
       int nr_bytes = (len + 7) / 8;
-      if (nr_bytes * 2 > sizeof(buffer))
+      if (nr_bytes > vector_size)
         {
           fprintf(stderr, "buffer size exceeded\n");
           return 1;
         }
 
-      if (sread(fd, buffer, nr_bytes * 2) != 1)
+      if (compressed)
+        {
+          zin_begin(&zin, fd);
+          if (zbits_decode(zread, &zin, buffer, nr_bytes) < 0)
+            {
+              fprintf(stderr, "decoding compressed data failed\n");
+              return 1;
+            }
+        }
+      else if (sread(fd, buffer, nr_bytes) != 1)
+        {
+          fprintf(stderr, "reading data failed\n");
+          return 1;
+        }
+
+      if (can_cut_through(buffer, len))
+        {
+          int idle = dont_care(buffer, len);
+          unsigned long tdo_transfers;
+          int dr_bits, download, r;
+
+          PROBE3(shift, len, istate, compressed);
+          stats.shifts++;
+          stats.bits += len;
+          profile_shift(prof, len);
+          memset(result, 0, nr_bytes);
+          if (wb_flush() < 0)
+            return 1;
+          tdo_transfers = io_tdo_transfers;
+          dr_bits = trace_scan(buffer, NULL, len);
+          download = cfg_download && dr_bits >= CFG_DOWNLOAD_MIN_BITS;
+          io_download(download);
+          if (compressed)
+            r = zshift_cut_through(&zin, buffer, buffer + nr_bytes, result,
+                                   zresult, !download, len);
+          else
+            r = shift_cut_through(fd, buffer, buffer + nr_bytes, result,
+                                  !download, len);
+          io_download(0);
+          if (r)
+            return 1;
+          if (idle)
+            prof->wasted += io_tdo_transfers - tdo_transfers;
+          if (verbose)
+            printf("jtag state %s\n", state_name[jtag_state]);
+          continue;
+        }
+      else if (compressed)
+        {
+          if (zbits_decode(zread, &zin, buffer + nr_bytes, nr_bytes) < 0
+              || zin_end(&zin) < 0)
+            {
+              fprintf(stderr, "decoding compressed data failed\n");
+              return 1;
+            }
+        }
+      else if (sread(fd, buffer + nr_bytes, nr_bytes) != 1)
         {
           fprintf(stderr, "reading data failed\n");
           return 1;
         }
+      PROBE3(shift, len, istate, compressed);
+      stats.shifts++;
+      stats.bits += len;
+      profile_shift(prof, len);
 
       memset(result, 0, nr_bytes);
 
@@ -188,15 +1766,6 @@ int handle_data(int fd)
           printf("\n");
         }
 
-      //
-      // Only allow exiting if the state is rti and the IR
-      // has the default value (IDCODE) by going through test_logic_reset.
-      // As soon as going through capture_dr or capture_ir no exit is
-      // allowed as this will change DR/IR.
-      //
-      seen_tlr = (seen_tlr || jtag_state == test_logic_reset) && (jtag_state != capture_dr) && (jtag_state != capture_ir);
-
-
       //
       // Due to a weird bug(??) xilinx impacts goes through another "capture_ir"/"capture_dr" cycle after
       // reading IR/DR which unfortunately sets IR to the read-out IR value.
@@ -207,22 +1776,30 @@ int handle_data(int fd)
         {
           if (verbose)
             printf("ignoring bogus jtag state movement in jtag_state %d\n", jtag_state);
+          prof->bogus++;
         } else
         {
-          /* Trace the state.  */
-          for (i = 0; i < len; ++i)
-            {
-              enum jtag_state_t pstate = jtag_state;
-              int tms = !!(buffer[i/8] & (1<<(i&7)));
-              jtag_state = jtag_step(jtag_state, tms);
-              if (trace_protocol > 1 && jtag_state != pstate)
-                printf("jtag state %s\n", state_name[jtag_state]);
-            }
-          if (io_scan(buffer + nr_bytes, buffer, result, len) < 0)
+          int idle = dont_care(buffer, len);
+          int queue = write_behind && idle && len <= WB_MAX_BITS;
+          unsigned long tdo_transfers = io_tdo_transfers;
+          int dr_bits = trace_scan(buffer, buffer + nr_bytes, len);
+          int r;
+
+          if (queue)
+            r = wb_add(buffer, buffer + nr_bytes, len);
+          else if (cfg_download && dr_bits >= CFG_DOWNLOAD_MIN_BITS)
             {
-              fprintf(stderr, "io_scan failed\n");
-              exit(1);
+              /* TDO is ignored by the client, don't read it.  */
+              io_download(1);
+              r = wb_scan(buffer + nr_bytes, buffer, NULL, len);
+              io_download(0);
             }
+          else
+            r = wb_scan(buffer + nr_bytes, buffer, result, len);
+          if (r < 0)
+            return 1;
+          if (idle)
+            prof->wasted += io_tdo_transfers - tdo_transfers;
         }
 
       if (trace_protocol > 1
@@ -235,7 +1812,15 @@ int handle_data(int fd)
           printf("\n");
         }
 
-      if (write(fd, result, nr_bytes) != nr_bytes) {
+      if (compressed)
+        {
+          int zlen = zbits_encode(result, nr_bytes, zresult, 1);
+          if (write(fd, zresult, zlen) != zlen) {
+            perror("write");
+            return 1;
+          }
+        }
+      else if (write(fd, result, nr_bytes) != nr_bytes) {
         perror("write");
         return 1;
       }
@@ -246,6 +1831,168 @@ int handle_data(int fd)
   return 0;
 }
 
+// handle_data, on a cable opened again if it was replugged, then run
+// the shifts it left queued.
+static int handle_client(int fd)
+{
+  int r;
+
+  if (check_cable(fd) < 0)
+    return 1;
+  r = handle_data(fd);
+  if (wb_flush() < 0)
+    return 1;
+  return r;
+}
+
+//
+// Per-TAP endpoints, enabled with -N: port+1+k is a cable with device k
+// of the chain only.  Commands are handled one at a time; a client keeps
+// the cable while its TAP is out of run_test_idle/test_logic_reset.
+//
+static struct vtap vtaps[CHAIN_MAX_DEVICES];
+static int vtap_fd[CHAIN_MAX_DEVICES];
+static int n_vtaps;
+static struct vtap *conn_vtap[FD_SETSIZE];
+static int vtap_lock_fd = -1;
+
+//
+// Whether a connection is already open on the port of device K.  Each
+// device port takes a single client, which owns the device's state.
+//
+static int vtap_busy(int k, int maxfd)
+{
+  int fd;
+
+  for (fd = 0; fd <= maxfd; fd++)
+    if (conn_vtap[fd] == &vtaps[k])
+      return 1;
+  return 0;
+}
+
+static int handle_vtap(int fd, struct vtap *v)
+{
+  char cmd[16], info[32];
+  unsigned char *buffer = shift_buffer, *result = shift_result;
+  int state = jtag_state;
+  int len, nr_bytes;
+
+  memset(cmd, 0, 16);
+  if (sread(fd, cmd, 2) != 1)
+    return 1;
+  PROBE1(command, cmd);
+
+  if (memcmp(cmd, "ge", 2) == 0) {
+    if (sread(fd, cmd, 6) != 1)
+      return 1;
+    // The extensions work on the whole chain, not offered here.
+    sprintf(info, "xvcServer_v1.0:%u\n", vector_size);
+    if (write(fd, info, strlen(info)) != strlen(info)) {
+      perror("write");
+      return 1;
+    }
+    return 0;
+  } else if (memcmp(cmd, "se", 2) == 0) {
+    if (sread(fd, cmd, 9) != 1)
+      return 1;
+    if (write(fd, cmd + 5, 4) != 4) {
+      perror("write");
+      return 1;
+    }
+    return 0;
+  } else if (memcmp(cmd, "sh", 2) != 0) {
+    fprintf(stderr, "invalid cmd '%s'-ignoring\n", cmd);
+    return 0;
+  }
+
+  if (sread(fd, cmd, 4) != 1 || sread(fd, &len, 4) != 1)
+    return 1;
+  nr_bytes = (len + 7) / 8;
+  if (len <= 0 || nr_bytes > vector_size)
+    {
+      fprintf(stderr, "buffer size exceeded\n");
+      return 1;
+    }
+  if (sread(fd, buffer, nr_bytes * 2) != 1)
+    {
+      fprintf(stderr, "reading data failed\n");
+      return 1;
+    }
+  PROBE3(shift, len, v->state, 0);
+  stats.shifts++;
+  stats.bits += len;
+  profile_shift(prof, len);
+  profile_states(prof, v->state, buffer, len);
+
+  if (check_cable(fd) < 0 || v->dev >= chain.ndev)
+    return 1;
+  state = jtag_state;
+  if (vtap_acquire(v, &state) < 0
+      || vtap_scan(v, buffer, buffer + nr_bytes, result, len, &state) < 0)
+    {
+      cable_lost();
+      return 1;
+    }
+  tap_untracked(state, state == test_logic_reset);
+
+  if (write(fd, result, nr_bytes) != nr_bytes) {
+    perror("write");
+    return 1;
+  }
+  if (trace_protocol || verbose)
+    printf("tap %d: jtag state %s\n", v->dev, state_name[v->state]);
+
+  if (v->state == run_test_idle || v->state == test_logic_reset)
+    vtap_lock_fd = -1;
+  else
+    vtap_lock_fd = fd;
+  return 0;
+}
+
+// Handle a command of the client on FD, counting its USB transfers.
+static int handle_conn(int fd)
+{
+  int r;
+
+  count_transfers();
+  if (conn_prof[fd])
+    prof = conn_prof[fd];
+  r = conn_vtap[fd] ? handle_vtap(fd, conn_vtap[fd]) : handle_client(fd);
+  count_transfers();
+  prof = &prof_server;
+  return r;
+}
+
+static int listen_on(int port)
+{
+  struct sockaddr_in address;
+  int s, i;
+
+  s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (s < 0) {
+    perror("socket");
+    return -1;
+  }
+
+  i = 1;
+  setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &i, sizeof i);
+
+  address.sin_addr.s_addr = INADDR_ANY;
+  address.sin_port = htons(port);
+  address.sin_family = AF_INET;
+
+  if (bind(s, (struct sockaddr*)&address, sizeof(address)) < 0) {
+    perror("bind");
+    return -1;
+  }
+
+  if (listen(s, 1) < 0)	{
+    perror("listen");
+    return -1;
+  }
+  return s;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -256,11 +2003,16 @@ main(int argc, char **argv)
   int s;
   int c;
   char* desc = NULL;
+  char* firmware = NULL;
+  char* svf_file = NULL;
+  int per_tap = 0;
+  int stats_port = 0;
+  int stats_fd = -1;
   struct sockaddr_in address;
 
   opterr = 0;
 
-  while ((c = getopt(argc, argv, "vV:P:p:tT")) != -1) {
+  while ((c = getopt(argc, argv, "vV:P:p:f:C:b:s:NI:S:B:xnwtTA")) != -1) {
     switch (c) {
     case 'p':
       port = strtoul(optarg, NULL, 0);
@@ -271,6 +2023,52 @@ main(int argc, char **argv)
     case 'P':
       product = strtoul(optarg, NULL, 0);
       break;
+    case 'f':
+      firmware = optarg;
+      break;
+    case 'C':
+      out_chunk = strtoul(optarg, NULL, 0);
+      if (out_chunk < 1 || out_chunk > XPC_MAX_CHUNK) {
+        fprintf(stderr, "bad chunk size %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'b':
+      vector_size = strtoul(optarg, NULL, 0);
+      break;
+    case 'n':
+      cfg_fast = 0;
+      break;
+    case 'w':
+      write_behind = 1;
+      break;
+    case 's':
+      svf_file = optarg;
+      break;
+    case 'N':
+      per_tap = 1;
+      break;
+    case 'S':
+      stats_port = strtoul(optarg, NULL, 0);
+      break;
+    case 'B':
+      cable_count = strtoul(optarg, NULL, 0);
+      break;
+    case 'I':
+      {
+        char *p = optarg;
+        nirlens = 0;
+        while (*p && nirlens < CHAIN_MAX_DEVICES)
+          {
+            irlens[nirlens++] = strtoul(p, &p, 0);
+            if (*p == ',')
+              p++;
+          }
+      }
+      break;
+    case 'x':
+      extensions = 1;
+      break;
     case 'v':
       verbose++;
       break;
@@ -280,44 +2078,96 @@ main(int argc, char **argv)
     case 'T':
       trace_usb = 1;
       break;
+    case 'A':
+      profile_close = 1;
+      break;
     case '?':
-      fprintf(stderr, "usage: %s [-vtT] [-V vendor] [-P product] [-p port]\n",
+      fprintf(stderr, "usage: %s [-vtTnwxNA] [-V vendor] [-P product] [-p port] [-f firmware.hex]\n"
+              "          [-C words] [-b bytes] [-s file.svf] [-I irlen,...] [-S port]\n"
+              "          [-B cables]\n",
               argv[0]);
       fprintf(stderr, " -v   verbose\n");
-            fprintf(stderr, " -v   verbose\n");
-            fprintf(stderr, " -t   trace protocol\n");
+      fprintf(stderr, " -t   trace protocol\n");
+      fprintf(stderr, " -A   print the workload profile of each connection as it closes\n");
+      fprintf(stderr, " -f   load this FX2 firmware into an unconfigured cable\n");
+      fprintf(stderr, " -n   read TDO during configuration download\n");
+      fprintf(stderr, " -w   answer shifts that don't read TDO before running them\n");
+      fprintf(stderr, " -C   words per transfer when TDO is not read, 1 to %d (default\n"
+              "      %d during configuration download, 4 otherwise)\n",
+              XPC_MAX_CHUNK, XPC_MAX_CHUNK);
+      fprintf(stderr, " -b   largest vector offered to clients, in bytes (default 2048)\n");
+      fprintf(stderr, " -s   play this SVF (or .xsvf) file and exit\n");
+      fprintf(stderr, " -x   enable protocol extensions\n");
+      fprintf(stderr, " -N   one port per device of the chain, from port+1\n");
+      fprintf(stderr, " -I   IR lengths of the devices, from TDO\n");
+      fprintf(stderr, " -S   report statistics and the chain on this port\n");
+      fprintf(stderr, " -B   shift on this many cables at once, checking TDO\n");
       return 1;
     }
   }
 
-  if (io_init(vendor, product, desc)) {
-    fprintf(stderr, "io_init failed\n");
+  if (vector_size < 1 || vector_size > (64u << 20)) {
+    fprintf(stderr, "bad vector size %u\n", vector_size);
+    return 1;
+  }
+  make_info();
+  shift_buffer = malloc(2 * vector_size);
+  shift_result = malloc(vector_size);
+  shift_zresult = malloc(ZBITS_BOUND(vector_size));
+  if (!shift_buffer || !shift_result || !shift_zresult) {
+    perror("malloc");
     return 1;
   }
 
-  s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-  if (s < 0) {
-    perror("socket");
+  cable_vendor = vendor;
+  cable_product = product;
+  cable_desc = desc;
+  cable_firmware = firmware;
+  if (cable_count < 1 || cable_count > XPC_MAX_CABLES) {
+    fprintf(stderr, "bad cable count %d\n", cable_count);
     return 1;
   }
+  if (open_cables() < 0)
+    return 1;
 
-  i = 1;
-  setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &i, sizeof i);
+  if (svf_file) {
+    struct svf_report rep;
+    char report[256];
+    int state = test_logic_reset;
 
-  address.sin_addr.s_addr = INADDR_ANY;
-  address.sin_port = htons(port);
-  address.sin_family = AF_INET;
+    i = svf_play_file(svf_file, &state, &rep);
+    svf_report_str(&rep, report, sizeof(report));
+    printf("%s: %s", svf_file, report);
+    print_cables(stdout);
+    io_close();
+    return i < 0;
+  }
 
-  if (bind(s, (struct sockaddr*)&address, sizeof(address)) < 0) {
-    perror("bind");
-    return 1;
+  discover_chain();
+  chain_print(stdout, &chain);
+  if (per_tap) {
+    if (!chain_valid) {
+      fprintf(stderr, "chain discovery failed\n");
+      return 1;
+    }
+    vtap_setup(&chain);
+    n_vtaps = chain.ndev;
   }
+  stats.start = time(NULL);
 
-  if (listen(s, 1) < 0)	{
-    perror("listen");
-    return 1;
+  {
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_profile;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
   }
 
+  s = listen_on(port);
+  if (s < 0)
+    return 1;
+
   fd_set conn;
   int maxfd = 0;
 
@@ -326,39 +2176,97 @@ main(int argc, char **argv)
 
   maxfd = s;
 
+  if (stats_port) {
+    stats_fd = listen_on(stats_port);
+    if (stats_fd < 0)
+      return 1;
+    FD_SET(stats_fd, &conn);
+    if (stats_fd > maxfd)
+      maxfd = stats_fd;
+  }
+
+  for (i = 0; i < n_vtaps; i++) {
+    vtap_fd[i] = listen_on(port + 1 + i);
+    if (vtap_fd[i] < 0)
+      return 1;
+    FD_SET(vtap_fd[i], &conn);
+    if (vtap_fd[i] > maxfd)
+      maxfd = vtap_fd[i];
+    printf("device %d on port %d\n", i, port + 1 + i);
+  }
+
   if (1 || verbose)
     printf("waiting for connection on port %d...\n", port);
 
   while (1)  {
     fd_set read = conn, except = conn;
-    int fd;
+    int fd, k;
 
     //
     // Look for work to do.
     //
 
+    if (vtap_lock_fd >= 0) {
+      //
+      // A per-TAP client is in the middle of a scan: only listen to it.
+      //
+      FD_ZERO(&read);
+      FD_SET(vtap_lock_fd, &read);
+      if (stats_fd >= 0)
+        FD_SET(stats_fd, &read);
+    }
+
     if (select(maxfd + 1, &read, 0, &except, 0) < 0) {
-        perror("select");
-        break;
+        if (errno != EINTR) {
+          perror("select");
+          break;
+        }
+        FD_ZERO(&read);
+        FD_ZERO(&except);
       }
 
+    if (profile_request) {
+      profile_request = 0;
+      print_profiles(stdout);
+    }
+
     for (fd = 0; fd <= maxfd; ++fd) {
       if (FD_ISSET(fd, &read)) {
         //
         // Readable listen socket? Accept connection.
         //
 
-        if (fd == s)
+        for (k = 0; k < n_vtaps; k++)
+          if (fd == vtap_fd[k])
+            break;
+
+        if (fd == stats_fd)
+          {
+            int newfd = accept(fd, NULL, NULL);
+            if (newfd >= 0)
+              write_stats(newfd);
+          }
+        else if (fd == s || k < n_vtaps)
           {
             int newfd;
             socklen_t nsize = sizeof(address);
 
-            newfd = accept(s, (struct sockaddr*)&address, &nsize);
+            newfd = accept(fd, (struct sockaddr*)&address, &nsize);
             if (verbose)
               printf("connection accepted - fd %d\n", newfd);
+            PROBE2(conn__accept, newfd, fd == s ? port : port + 1 + k);
             if (newfd < 0)
               {
                 perror("accept");
+              }
+            else if (newfd >= FD_SETSIZE)
+              {
+                close(newfd);
+              }
+            else if (fd != s && vtap_busy(k, maxfd))
+              {
+                fprintf(stderr, "device %d already has a client\n", k);
+                close(newfd);
               } else
               {
                 if (newfd > maxfd)
@@ -366,20 +2274,34 @@ main(int argc, char **argv)
                     maxfd = newfd;
                   }
                 FD_SET(newfd, &conn);
+                stats.sessions++;
+                conn_prof[newfd] = calloc(1, sizeof(struct profile));
+                conn_generation[newfd] = 0;
+                conn_vtap[newfd] = NULL;
+                if (fd != s)
+                  {
+                    conn_vtap[newfd] = &vtaps[k];
+                    vtap_init(&vtaps[k], k, run_test_idle);
+                  }
               }
           }
         //
         // Otherwise, do work.
         //
-        else if (handle_data(fd)) {
+        else if (handle_conn(fd)) {
             //
             // Close connection when required.
             //
 
           if (verbose)
             printf("connection closed - fd %d\n", fd);
+          PROBE1(conn__close, fd);
+          end_profile(fd);
           close(fd);
           FD_CLR(fd, &conn);
+          if (fd == vtap_lock_fd)
+            vtap_lock_fd = -1;
+          conn_vtap[fd] = NULL;
         }
       }
       //
@@ -388,8 +2310,13 @@ main(int argc, char **argv)
       else if (FD_ISSET(fd, &except)) {
           if (verbose)
             printf("connection aborted - fd %d\n", fd);
+          PROBE1(conn__close, fd);
+          end_profile(fd);
           close(fd);
           FD_CLR(fd, &conn);
+          if (fd == vtap_lock_fd)
+            vtap_lock_fd = -1;
+          conn_vtap[fd] = NULL;
           if (fd == s)
             break;
       }
@@ -0,0 +1,198 @@
+#include <string.h>
+
+#include "zbits.h"
+
+// Minimum lengths worth a fill or a copy record.
+#define ZBITS_MIN_FILL 4
+#define ZBITS_MIN_COPY 6
+
+// Literals are read in pieces of this size, reporting progress.
+#define ZBITS_PIECE 4096
+
+#define ZBITS_HASH_BITS 12
+#define ZBITS_WINDOW (64 * 1024)
+
+static unsigned char *put_varint(unsigned char *d, unsigned v)
+{
+  while (v >= 0x80)
+    {
+      *d++ = (v & 0x7f) | 0x80;
+      v >>= 7;
+    }
+  *d++ = v;
+  return d;
+}
+
+static unsigned char *put_tag(unsigned char *d, int kind, unsigned count)
+{
+  if (count <= 63)
+    *d++ = (kind << 6) | (count - 1);
+  else
+    {
+      *d++ = (kind << 6) | 63;
+      d = put_varint(d, count - 64);
+    }
+  return d;
+}
+
+static unsigned char *put_literal(unsigned char *d, const unsigned char *src,
+                                  int count)
+{
+  if (count > 0)
+    {
+      d = put_tag(d, ZBITS_LITERAL, count);
+      memcpy(d, src, count);
+      d += count;
+    }
+  return d;
+}
+
+static unsigned hash4(const unsigned char *p)
+{
+  unsigned v = p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned)p[3] << 24);
+  return (v * 2654435761u) >> (32 - ZBITS_HASH_BITS);
+}
+
+int zbits_encode(const unsigned char *src, int len, unsigned char *dst,
+                 int lz)
+{
+  int table[1 << ZBITS_HASH_BITS];
+  unsigned char *d = dst;
+  int lit = 0;
+  int i = 0;
+
+  if (lz)
+    memset(table, 0xff, sizeof(table));
+
+  while (i < len)
+    {
+      int run = 1;
+
+      while (i + run < len && src[i + run] == src[i])
+        run++;
+      if (run >= ZBITS_MIN_FILL)
+        {
+          d = put_literal(d, src + lit, i - lit);
+          d = put_tag(d, ZBITS_FILL, run);
+          *d++ = src[i];
+          i += run;
+          lit = i;
+          continue;
+        }
+
+      if (lz && i + 4 <= len)
+        {
+          unsigned h = hash4(src + i);
+          int cand = table[h];
+
+          table[h] = i;
+          if (cand >= 0 && i - cand <= ZBITS_WINDOW
+              && memcmp(src + cand, src + i, 4) == 0)
+            {
+              int m = 4;
+
+              while (i + m < len && src[cand + m] == src[i + m])
+                m++;
+              if (m >= ZBITS_MIN_COPY)
+                {
+                  d = put_literal(d, src + lit, i - lit);
+                  d = put_tag(d, ZBITS_COPY, m);
+                  d = put_varint(d, i - cand);
+                  i += m;
+                  lit = i;
+                  continue;
+                }
+            }
+        }
+      i++;
+    }
+
+  d = put_literal(d, src + lit, i - lit);
+  return d - dst;
+}
+
+static int get_varint(zbits_read_fn read, void *arg, unsigned *v)
+{
+  unsigned char b;
+  int shift = 0;
+
+  *v = 0;
+  do
+    {
+      if (shift > 28 || read(arg, &b, 1) != 1)
+        return -1;
+      *v |= (unsigned)(b & 0x7f) << shift;
+      shift += 7;
+    }
+  while (b & 0x80);
+  return 0;
+}
+
+int zbits_decode(zbits_read_fn read, void *arg, unsigned char *dst,
+                 int len)
+{
+  return zbits_decode_progress(read, arg, dst, len, NULL);
+}
+
+int zbits_decode_progress(zbits_read_fn read, void *arg,
+                          unsigned char *dst, int len,
+                          zbits_progress_fn progress)
+{
+  int pos = 0;
+
+  while (pos < len)
+    {
+      unsigned char tag, fill;
+      unsigned count, dist;
+
+      if (progress)
+        progress(arg, pos);
+      if (read(arg, &tag, 1) != 1)
+        return -1;
+      count = (tag & 63) + 1;
+      if (count == 64)
+        {
+          if (get_varint(read, arg, &count) < 0)
+            return -1;
+          count += 64;
+        }
+      if (count > (unsigned)(len - pos))
+        return -1;
+
+      switch (tag >> 6)
+        {
+        case ZBITS_LITERAL:
+          while (progress && count > ZBITS_PIECE)
+            {
+              if (read(arg, dst + pos, ZBITS_PIECE) != 1)
+                return -1;
+              pos += ZBITS_PIECE;
+              count -= ZBITS_PIECE;
+              progress(arg, pos);
+            }
+          if (read(arg, dst + pos, count) != 1)
+            return -1;
+          break;
+        case ZBITS_FILL:
+          if (read(arg, &fill, 1) != 1)
+            return -1;
+          memset(dst + pos, fill, count);
+          break;
+        case ZBITS_COPY:
+          if (get_varint(read, arg, &dist) < 0
+              || dist == 0 || dist > (unsigned)pos)
+            return -1;
+          // Byte by byte: the source may overlap the destination.
+          while (count--)
+            {
+              dst[pos] = dst[pos - dist];
+              pos++;
+            }
+          continue;
+        default:
+          return -1;
+        }
+      pos += count;
+    }
+  return 0;
+}
@@ -0,0 +1,42 @@
+//
+// Compression of bit vectors for the zshift: extension.
+//
+// A stream is a sequence of records, each starting with a tag byte: the
+// two high bits give the kind, the six low bits the byte count minus one
+// (63 means 64 plus a LEB128 varint that follows).
+//
+//   ZBITS_LITERAL  count bytes follow
+//   ZBITS_FILL     one byte follows, repeated count times
+//   ZBITS_COPY     LEB128 distance follows; count bytes are copied from
+//                  that far back in the output (LZ77 style, may overlap)
+//
+// The decoder stops when the expected number of bytes has been produced.
+//
+
+enum { ZBITS_LITERAL, ZBITS_FILL, ZBITS_COPY };
+
+// Size of the buffer needed to encode LEN bytes.
+#define ZBITS_BOUND(len) ((len) + (len) / 64 + 16)
+
+// Encode LEN bytes of SRC into DST; return the encoded size.  Back
+// references are only searched if LZ.
+int zbits_encode(const unsigned char *src, int len, unsigned char *dst,
+                 int lz);
+
+// Read LEN bytes from the input stream; return 1 on success.
+typedef int (*zbits_read_fn)(void *arg, void *buf, int len);
+
+// Called before each record, and within long literals, with the number
+// of bytes of DST decoded so far, so that they can be used while the
+// rest arrives.
+typedef void (*zbits_progress_fn)(void *arg, int done);
+
+// Decode into the LEN bytes of DST, reading the stream with READ.
+// Return 0 on success, -1 on error.
+int zbits_decode(zbits_read_fn read, void *arg, unsigned char *dst,
+                 int len);
+
+// zbits_decode, calling PROGRESS with ARG as well.
+int zbits_decode_progress(zbits_read_fn read, void *arg,
+                          unsigned char *dst, int len,
+                          zbits_progress_fn progress);